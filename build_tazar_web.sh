@@ -8,5 +8,7 @@ mkdir tazar-web
 cp bin/tazar-bot.js tazar-web/
 cp bin/tazar-bot.wasm tazar-web/
 cp bin/tazar-bot.html tazar-web/index.html
+# The opening book, preloaded if tazar.book was there at configure time.
+if [ -f bin/tazar-bot.data ]; then cp bin/tazar-bot.data tazar-web/; fi
 zip -r tazar-web.zip tazar-web
 popd || exit
\ No newline at end of file
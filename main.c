@@ -11,17 +11,42 @@
 
 #include "tazar.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 
 // Now that the basics are working. Here's the next steps.
 // * See if I can get my own font working, I like the berkeley one.
 //   * Having problems with highdpi, not sure how to fix that yet.
 //   * https://github.com/ocornut/imgui/issues/7779
-// * Get SIMD working on the main platforms, and then get SIMD working in wasm.
-// * Build an arena that I can use in wasm builds too.
 // * Get CMAKE to build release bundles for the platforms that handle portable packaging and assets
 // correctly.
 
+// Where "Log to file" appends the stats of each AI search, one JSON object a line.
+#define SEARCH_STATS_PATH "search_stats.jsonl"
+// Opening book from tazar_book, the AI searches every position if it isn't there.
+#define BOOK_PATH "tazar.book"
+
+// The AI runs on one thread for the whole app, so the search's threads and state stay warm and
+// the web build doesn't take a thread from its pool for every command. The UI posts a request,
+// a search or a ponder of `AppState.ai_turn`, and polls for the response. At most one request
+// is out at a time.
+typedef enum {
+    AI_WORKER_IDLE,      // No request, the UI owns ai_turn.
+    AI_WORKER_REQUESTED, // Posted, the worker hasn't picked it up yet.
+    AI_WORKER_RUNNING,
+    AI_WORKER_DONE, // The response is in ai_turn, waiting for the UI to take it.
+} AIWorkerState;
+
+typedef struct {
+    SDL_Thread *thread;
+    SDL_Mutex *mutex; // Guards state and quit.
+    SDL_Condition *changed;
+    AIWorkerState state;
+    bool quit;
+    AITurn *ai_turn;
+    int result; // Of ai_select_command, set with AI_WORKER_DONE.
+} AIWorker;
+
 typedef enum {
     UI_STATE_WAITING_FOR_SELECTION,
     UI_STATE_WAITING_FOR_COMMAND,
@@ -41,7 +66,10 @@ typedef struct {
     ImGuiIO *io;
 
     AITurn ai_turn;
-    SDL_Thread *ai_turn_thread;
+    AIWorker ai_worker;
+    AITurn last_ai_turn; // Copy of ai_turn after its last search, for the stats panel.
+    bool log_search_stats;
+    u64 ponder_hash; // Position last pondered, so a ponder that ends by itself isn't restarted.
 
     int ai_preview_frames_left;
 
@@ -57,6 +85,98 @@ typedef struct {
     char command_log[4096];
 } AppState;
 
+static int ai_worker_main(void *ptr) {
+    AIWorker *worker = ptr;
+    SDL_LockMutex(worker->mutex);
+    for (;;) {
+        while (worker->state != AI_WORKER_REQUESTED && !worker->quit) {
+            SDL_WaitCondition(worker->changed, worker->mutex);
+        }
+        if (worker->quit) {
+            break;
+        }
+        worker->state = AI_WORKER_RUNNING;
+        SDL_UnlockMutex(worker->mutex);
+        int result = ai_select_command(worker->ai_turn);
+        SDL_LockMutex(worker->mutex);
+        worker->result = result;
+        worker->state = AI_WORKER_DONE;
+        SDL_BroadcastCondition(worker->changed);
+    }
+    SDL_UnlockMutex(worker->mutex);
+    return 0;
+}
+
+static bool ai_worker_start(AIWorker *worker, AITurn *ai_turn) {
+    worker->thread = NULL;
+    worker->mutex = SDL_CreateMutex();
+    worker->changed = SDL_CreateCondition();
+    worker->state = AI_WORKER_IDLE;
+    worker->quit = false;
+    worker->ai_turn = ai_turn;
+    worker->result = 0;
+    if (worker->mutex == NULL || worker->changed == NULL) {
+        return false;
+    }
+    worker->thread = SDL_CreateThread(ai_worker_main, "ai_worker", worker);
+    return worker->thread != NULL;
+}
+
+static AIWorkerState ai_worker_state(AIWorker *worker) {
+    SDL_LockMutex(worker->mutex);
+    AIWorkerState state = worker->state;
+    SDL_UnlockMutex(worker->mutex);
+    return state;
+}
+
+// Search or ponder `ai_turn` as it's set up now, the worker must be idle.
+static void ai_worker_request(AIWorker *worker) {
+    atomic_store(&worker->ai_turn->stop, false);
+    atomic_store(&worker->ai_turn->best_so_far, 0);
+    SDL_LockMutex(worker->mutex);
+    assert(worker->state == AI_WORKER_IDLE);
+    worker->state = AI_WORKER_REQUESTED;
+    SDL_BroadcastCondition(worker->changed);
+    SDL_UnlockMutex(worker->mutex);
+}
+
+// Take the response if there is one, the worker is idle again after.
+static bool ai_worker_poll(AIWorker *worker, int *result) {
+    SDL_LockMutex(worker->mutex);
+    bool done = worker->state == AI_WORKER_DONE;
+    if (done) {
+        *result = worker->result;
+        worker->state = AI_WORKER_IDLE;
+    }
+    SDL_UnlockMutex(worker->mutex);
+    return done;
+}
+
+// Stop the request that's out, if any, and drop its response.
+static void ai_worker_cancel(AIWorker *worker) {
+    ai_stop(worker->ai_turn);
+    SDL_LockMutex(worker->mutex);
+    while (worker->state == AI_WORKER_REQUESTED || worker->state == AI_WORKER_RUNNING) {
+        SDL_WaitCondition(worker->changed, worker->mutex);
+    }
+    worker->state = AI_WORKER_IDLE;
+    SDL_UnlockMutex(worker->mutex);
+}
+
+static void ai_worker_quit(AIWorker *worker) {
+    if (worker->thread != NULL) {
+        ai_worker_cancel(worker);
+        SDL_LockMutex(worker->mutex);
+        worker->quit = true;
+        SDL_BroadcastCondition(worker->changed);
+        SDL_UnlockMutex(worker->mutex);
+        SDL_WaitThread(worker->thread, NULL);
+        worker->thread = NULL;
+    }
+    SDL_DestroyCondition(worker->changed);
+    SDL_DestroyMutex(worker->mutex);
+}
+
 SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
     UNUSED(argc);
     UNUSED(argv);
@@ -97,7 +217,7 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
 
     game_init(&app->game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
     game_valid_commands(&app->command_buf, &app->game);
-    assert(app->command_buf.count <= 1024);
+    assert(app->command_buf.count <= COMMANDS_MAX);
 
     app->ui_state = UI_STATE_WAITING_FOR_SELECTION;
     app->selected_piece = 0;
@@ -107,6 +227,29 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
     app->difficulty = 0;
     app->command_log[0] = '\0';
 
+    app->ai_turn.ai_state = NULL;
+    app->ai_turn.tt_size_mb = 0;
+    app->ai_turn.time_budget_ms = 0;
+    app->ai_turn.max_depth = 0;
+    app->ai_turn.threads = 0;
+    app->ai_turn.parallel = AI_PARALLEL_LAZY_SMP;
+    app->ai_turn.plan_turns = false;
+    app->ai_turn.ponder = false;
+    app->ai_turn.playouts = 0;
+    app->ai_turn.max_nodes = 0;
+    app->ai_turn.search_always = false;
+    app->ai_turn.book = ai_book_open(BOOK_PATH);
+    if (app->ai_turn.book == NULL) {
+        SDL_Log("No opening book at %s", BOOK_PATH);
+    }
+    if (!ai_worker_start(&app->ai_worker, &app->ai_turn)) {
+        SDL_Log("Couldn't start the AI thread: %s", SDL_GetError());
+        return SDL_APP_FAILURE;
+    }
+    app->last_ai_turn = (AITurn){0};
+    app->log_search_stats = false;
+    app->ponder_hash = 0;
+
     return SDL_APP_CONTINUE;
 }
 
@@ -146,6 +289,9 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
         if (ImGui_BeginMenuBar()) {
             if (ImGui_BeginMenu("Game")) {
                 if (ImGui_MenuItem("New Game")) {
+                    // The search is of the old game, stop it and drop its command.
+                    ai_worker_cancel(&app->ai_worker);
+                    app->ponder_hash = 0;
                     game_init(&app->game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
                     game_valid_commands(&app->command_buf, &app->game);
                     app->ui_state = UI_STATE_WAITING_FOR_SELECTION;
@@ -166,7 +312,35 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
             // Difficulty selector
             ImGui_Text("Difficulty");
-            ImGui_Combo("##difficulty", &app->difficulty, "Human\0Easy\0Medium\0");
+            ImGui_Combo("##difficulty", &app->difficulty, "Human\0Easy\0Medium\0Hard\0MCTS\0");
+            ImGui_Separator();
+
+            // Stats of the last AI search.
+            if (ImGui_CollapsingHeader("Search Stats", 0)) {
+                AITurn *last = &app->last_ai_turn;
+                AIStats *stats = &last->stats;
+                ImGui_Text("Depth %u, score %.3f", last->depth_completed, last->score);
+                if (last->planned) {
+                    ImGui_Text("From the turn plan, no search");
+                } else if (last->from_book) {
+                    ImGui_Text("From the opening book, no search");
+                }
+                ImGui_Text("Nodes %" PRIu64 ", %.0f/s", last->nodes, stats->nps);
+                ImGui_Text("Time %.0f ms", stats->elapsed_ms);
+                ImGui_Text("Leaf evals %" PRIu64, stats->leaf_evals);
+                ImGui_Text("Chance nodes %" PRIu64, stats->chance_nodes);
+                ImGui_Text("Branching %.2f", stats->branching);
+                u64 probes = stats->tt_probes;
+                ImGui_Text("TT hits %" PRIu64 "/%" PRIu64 " (%.0f%%)", stats->tt_hits, probes,
+                           probes > 0 ? 100.0 * (double)stats->tt_hits / (double)probes : 0.0);
+                ImGui_Text("Cutoffs by depth");
+                for (u32 i = 0; i <= AI_MAX_DEPTH; i++) {
+                    if (stats->cutoffs[i] > 0) {
+                        ImGui_Text("  %u: %" PRIu64, i, stats->cutoffs[i]);
+                    }
+                }
+                ImGui_Checkbox("Log to " SEARCH_STATS_PATH, &app->log_search_stats);
+            }
             ImGui_Separator();
 
             // Command log
@@ -527,7 +701,32 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
         // u32 counter = SDL_GetAtomicU32(&app->counter);
         if (app->ui_state == UI_STATE_AI_THINKING) {
-            ImGui_ProgressBar(-1.0f * (float)ImGui_GetTime(), (ImVec2){-1, 0}, "AI Thinking...");
+            // Stopping makes the AI play the best command it has so far.
+            if (ImGui_Button("Move Now")) {
+                ai_stop(&app->ai_turn);
+            }
+            ImGui_SameLine();
+            char overlay[64] = "AI Thinking...";
+            u32 best_i;
+            double best_score;
+            if (ai_best_so_far(&app->ai_turn, &best_i, &best_score)) {
+                char best_text[COMMAND_TEXT_MAX];
+                command_format(app->command_buf.commands[best_i], best_text, sizeof(best_text));
+                snprintf(overlay, sizeof(overlay), "AI Thinking... %s (%.3f)", best_text,
+                         best_score);
+            }
+            ImGui_ProgressBar(-1.0f * (float)ImGui_GetTime(), (ImVec2){-1, 0}, overlay);
+        } else if (app->ai_turn.ponder &&
+                   ai_worker_state(&app->ai_worker) != AI_WORKER_IDLE) {
+            u32 best_i;
+            double best_score;
+            if (ai_best_so_far(&app->ai_turn, &best_i, &best_score)) {
+                char best_text[COMMAND_TEXT_MAX];
+                command_format(app->command_buf.commands[best_i], best_text, sizeof(best_text));
+                ImGui_Text("AI Pondering... expects %s", best_text);
+            } else {
+                ImGui_Text("AI Pondering...");
+            }
         }
         ImGui_EndGroup();
     }
@@ -547,20 +746,25 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
     cImGui_ImplSDLRenderer3_RenderDrawData(ImGui_GetDrawData(), app->renderer);
     SDL_RenderPresent(app->renderer);
 
+    // A ponder ends by itself when it finds the game decided, there's nothing to take from it.
+    int ai_result;
+    if (app->ai_turn.ponder) {
+        ai_worker_poll(&app->ai_worker, &ai_result);
+    }
+
     // AI Turn
     if (app->ui_state == UI_STATE_AI_THINKING) {
-        SDL_ThreadState state = SDL_GetThreadState(app->ai_turn_thread);
-        if (state == SDL_THREAD_ALIVE) {
-            // AI is still thinking.
-        } else if (state == SDL_THREAD_COMPLETE) {
+        if (ai_worker_poll(&app->ai_worker, &ai_result)) {
             // AI has finished thinking.
-            int thread_result;
-            SDL_WaitThread(app->ai_turn_thread, &thread_result);
-            if (thread_result != 0) {
+            if (ai_result != 0) {
                 // Something went wrong.
                 assert(false);
             }
-            app->ai_turn_thread = NULL;
+            app->last_ai_turn = app->ai_turn;
+            if (app->log_search_stats &&
+                !ai_stats_append_json(SEARCH_STATS_PATH, &app->ai_turn)) {
+                SDL_Log("Couldn't append to %s", SEARCH_STATS_PATH);
+            }
             u32 selected_command_i = app->ai_turn.selected_command_i;
             app->selected_command = app->command_buf.commands[selected_command_i];
             app->selected_piece = *game_piece(&app->game, app->selected_command.piece_pos);
@@ -568,9 +772,6 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
             app->ai_preview_frames_left = 60 * 3;
             app->ui_state = UI_STATE_AI_PREVIEW;
-        } else {
-            // Something went wrong.
-            assert(false);
         }
     }
 
@@ -581,6 +782,9 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
     }
 
     if (apply_command) {
+        // The position pondered on is about to change.
+        ai_worker_cancel(&app->ai_worker);
+
         // Log the command
         char log_entry[256];
         const char *player = (app->game.turn.player == PLAYER_RED) ? "Red" : "Blue";
@@ -642,7 +846,7 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
         game_apply_command(&app->game, app->game.turn.player, app->selected_command, VOLLEY_ROLL);
         game_valid_commands(&app->command_buf, &app->game);
-        assert(app->command_buf.count <= 1024);
+        assert(app->command_buf.count <= COMMANDS_MAX);
 
         bool piece_still_exists = false;
         CPos new_piece_cpos = (CPos){0, 0, 0};
@@ -668,7 +872,7 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
                                },
                                VOLLEY_ROLL);
             game_valid_commands(&app->command_buf, &app->game);
-            assert(app->command_buf.count <= 1024);
+            assert(app->command_buf.count <= COMMANDS_MAX);
             app->ui_state = UI_STATE_WAITING_FOR_SELECTION;
             app->selected_piece = 0;
             app->selected_cpos = (CPos){0, 0, 0};
@@ -709,15 +913,30 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
         AIDifficulty ai_difficulty = (AIDifficulty)app->difficulty;
         app->ai_preview_frames_left = 0;
 
+        ai_worker_cancel(&app->ai_worker);
         app->ai_turn.game = app->game;
         app->ai_turn.difficulty = ai_difficulty;
+        app->ai_turn.ponder = false;
         app->ai_turn.selected_command_i = 0;
-
-        app->ai_turn_thread =
-            SDL_CreateThread(ai_select_command, "ai_select_command", &app->ai_turn);
+        ai_worker_request(&app->ai_worker);
         app->ui_state = UI_STATE_AI_THINKING;
     }
 
+    // The human's think time is free, ponder their position for the AI. Its search of the reply
+    // then starts from the transposition table or tree the ponder left in ai_state.
+    bool human_to_move = (app->ui_state == UI_STATE_WAITING_FOR_SELECTION ||
+                          app->ui_state == UI_STATE_WAITING_FOR_COMMAND) &&
+                         app->game.status == STATUS_IN_PROGRESS &&
+                         app->game.turn.player == PLAYER_RED && app->difficulty != 0;
+    if (human_to_move && ai_worker_state(&app->ai_worker) == AI_WORKER_IDLE &&
+        app->ponder_hash != app->game.hash) {
+        app->ai_turn.game = app->game;
+        app->ai_turn.difficulty = (AIDifficulty)app->difficulty;
+        app->ai_turn.ponder = true;
+        ai_worker_request(&app->ai_worker);
+        app->ponder_hash = app->game.hash;
+    }
+
     if (app->game.status == STATUS_OVER) {
         app->ui_state = UI_STATE_GAME_OVER;
     }
@@ -730,6 +949,12 @@ void SDL_AppQuit(void *appstate, SDL_AppResult result) {
 
     AppState *app = (AppState *)appstate;
 
+    ai_worker_quit(&app->ai_worker);
+    ai_state_free(app->ai_turn.ai_state);
+    app->ai_turn.ai_state = NULL;
+    ai_book_close(app->ai_turn.book);
+    app->ai_turn.book = NULL;
+
     cImGui_ImplSDLRenderer3_Shutdown();
     cImGui_ImplSDL3_Shutdown();
     ImGui_DestroyContext(app->imgui_context);
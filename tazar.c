@@ -2,32 +2,100 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// SIMD for the board kernels, picked at compile time. Anything else uses the scalar loops.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SIMD_WASM
+#endif
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 
-double random_prob() {
-    float rand_f = emscripten_random();
-    return (double)rand_f;
+double time_now_ms() {
+    return emscripten_get_now();
 }
 
-u32 rand_in_range(u32 min, u32 max) {
-    float rand_f = emscripten_random();
-    return (u32)(rand_f * (float)(max - min)) + min;
+static u64 rand_entropy() {
+    return (u64)(emscripten_random() * 4294967296.0) << 32 ^ (u64)(emscripten_get_now() * 1000.0);
 }
 
 #else
 
+double time_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static u64 rand_entropy() {
+    return (u64)arc4random() << 32 | arc4random();
+}
+
+#endif
+
+// xorshift64*, one per thread so concurrent games each replay their own dice. Seeded from the
+// platform's entropy until `rand_seed` is called.
+static _Thread_local u64 rand_state;
+
+void rand_seed(u64 seed) {
+    rand_state = seed * 0x9e3779b97f4a7c15ull | 1;
+}
+
+static u64 rand_next() {
+    if (rand_state == 0) {
+        rand_state = rand_entropy() | 1;
+    }
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545f4914f6cdd1dull;
+}
+
 double random_prob() {
-    return drand48();
+    return (double)(rand_next() >> 11) * 0x1.0p-53;
 }
 
 u32 rand_in_range(u32 min, u32 max) {
-    return arc4random_uniform(max - min) + min;
+    return (u32)(((rand_next() >> 32) * (u64)(max - min)) >> 32) + min;
 }
 
-#endif
+void arena_init(Arena *arena, size_t capacity) {
+    arena->base = malloc(capacity);
+    assert(arena->base != NULL);
+    arena->capacity = capacity;
+    arena->used = 0;
+}
+
+void arena_free(Arena *arena) {
+    free(arena->base);
+    *arena = (Arena){0};
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size_t start = (arena->used + 15) & ~(size_t)15;
+    if (start + size > arena->capacity) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
 
 bool cpos_eq(CPos a, CPos b) {
     return a.q == b.q && a.r == b.r && a.s == b.s;
@@ -50,7 +118,34 @@ CPos cpos_from_v2(V2 dpos) {
     return (CPos){q, r, s};
 }
 
-// todo: bring back game_eq for mcts tree re-use.
+static bool order_eq(Order a, Order b) {
+    return a.kind == b.kind && cpos_eq(a.target, b.target);
+}
+
+static bool turn_eq(Turn *a, Turn *b) {
+    if (a->player != b->player || a->activation_i != b->activation_i) {
+        return false;
+    }
+    for (u32 i = 0; i < 2; i++) {
+        Activation *aa = &a->activations[i];
+        Activation *ba = &b->activations[i];
+        if (aa->piece != ba->piece || aa->order_i != ba->order_i) {
+            return false;
+        }
+        for (u32 j = 0; j < 2; j++) {
+            if (!order_eq(aa->orders[j], ba->orders[j])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool game_eq(Game *a, Game *b) {
+    return a->hash == b->hash && a->status == b->status && a->winner == b->winner &&
+           memcmp(a->board, b->board, sizeof(a->board)) == 0 && turn_eq(&a->turn, &b->turn);
+}
+
 #if 0
 
 static Tile tile_null = TILE_NONE;
@@ -163,11 +258,495 @@ u8 *game_piece(Game *game, CPos pos) {
     return &game->board[(pos.r + 4) * 9 + (pos.q + 4)];
 }
 
+static size_t cpos_index(CPos pos) {
+    assert(pos.q >= -4 && pos.q <= 4 && pos.r >= -4 && pos.r <= 4);
+    return (size_t)((pos.r + 4) * 9 + (pos.q + 4));
+}
+
+// Bitboards.
+
+static BitBoard bb_or(BitBoard a, BitBoard b) {
+    return (BitBoard){a.lo | b.lo, a.hi | b.hi};
+}
+
+static BitBoard bb_and(BitBoard a, BitBoard b) {
+    return (BitBoard){a.lo & b.lo, a.hi & b.hi};
+}
+
+// a & ~b
+static BitBoard bb_andnot(BitBoard a, BitBoard b) {
+    return (BitBoard){a.lo & ~b.lo, a.hi & ~b.hi};
+}
+
+static BitBoard bb_shl(BitBoard a, u32 n) {
+    assert(n > 0 && n < 64);
+    return (BitBoard){a.lo << n, a.hi << n | a.lo >> (64 - n)};
+}
+
+static BitBoard bb_shr(BitBoard a, u32 n) {
+    assert(n > 0 && n < 64);
+    return (BitBoard){a.lo >> n | a.hi << (64 - n), a.hi >> n};
+}
+
+static bool bb_empty(BitBoard a) {
+    return (a.lo | a.hi) == 0;
+}
+
+static BitBoard bb_bit(size_t i) {
+    assert(i < 128);
+    if (i < 64) {
+        return (BitBoard){(u64)1 << i, 0};
+    }
+    return (BitBoard){0, (u64)1 << (i - 64)};
+}
+
+// Clear the lowest set bit and return its index.
+static size_t bb_pop(BitBoard *a) {
+    assert(!bb_empty(*a));
+    if (a->lo != 0) {
+        size_t i = (size_t)__builtin_ctzll(a->lo);
+        a->lo &= a->lo - 1;
+        return i;
+    }
+    size_t i = (size_t)__builtin_ctzll(a->hi) + 64;
+    a->hi &= a->hi - 1;
+    return i;
+}
+
+// Slots with q == 4 and q == -4, shifting along q from these would wrap into the next row.
+static const BitBoard bb_q_max = {0x4020100804020100ull, 0x0000000000010080ull};
+static const BitBoard bb_q_min = {0x8040201008040201ull, 0x0000000000000100ull};
+
+// Every tile one step from a tile in `from`.
+// Moving along q is a shift by 1, along r by 9 and along both (right up, left down) by 8.
+static BitBoard bb_neighbors(BitBoard from, BitBoard cells) {
+    BitBoard not_q_max = bb_andnot(from, bb_q_max);
+    BitBoard not_q_min = bb_andnot(from, bb_q_min);
+    BitBoard n = bb_shr(not_q_max, 8);         // right up
+    n = bb_or(n, bb_shl(not_q_max, 1));        // right
+    n = bb_or(n, bb_shl(from, 9));             // right down
+    n = bb_or(n, bb_shl(not_q_min, 8));        // left down
+    n = bb_or(n, bb_shr(not_q_min, 1));        // left
+    n = bb_or(n, bb_shr(from, 9));             // left up
+    return bb_and(n, cells);
+}
+
+// Cell tables.
+// The 61 tiles of "Hex Field Small" get a dense cell index, 0..60 in board order, so per cell
+// data doesn't waste the 20 unused slots of the 9x9 board. Generated for this map, if more maps
+// are added these become per map. CELL_COUNT and CELL_NONE are in tazar.h.
+
+// Neighbor order in `cell_neighbors`.
+typedef enum {
+    DIR_RIGHT_UP = 0,
+    DIR_RIGHT,
+    DIR_RIGHT_DOWN,
+    DIR_LEFT_DOWN,
+    DIR_LEFT,
+    DIR_LEFT_UP,
+} Direction;
+
+static const CPos cell_cpos[CELL_COUNT] = {
+    {0, -4, 4}, {1, -4, 3}, {2, -4, 2}, {3, -4, 1}, {4, -4, 0}, {-1, -3, 4}, {0, -3, 3}, {1, -3, 2},
+    {2, -3, 1}, {3, -3, 0}, {4, -3, -1}, {-2, -2, 4}, {-1, -2, 3}, {0, -2, 2}, {1, -2, 1},
+    {2, -2, 0}, {3, -2, -1}, {4, -2, -2}, {-3, -1, 4}, {-2, -1, 3}, {-1, -1, 2}, {0, -1, 1},
+    {1, -1, 0}, {2, -1, -1}, {3, -1, -2}, {4, -1, -3}, {-4, 0, 4}, {-3, 0, 3}, {-2, 0, 2},
+    {-1, 0, 1}, {0, 0, 0}, {1, 0, -1}, {2, 0, -2}, {3, 0, -3}, {4, 0, -4}, {-4, 1, 3}, {-3, 1, 2},
+    {-2, 1, 1}, {-1, 1, 0}, {0, 1, -1}, {1, 1, -2}, {2, 1, -3}, {3, 1, -4}, {-4, 2, 2}, {-3, 2, 1},
+    {-2, 2, 0}, {-1, 2, -1}, {0, 2, -2}, {1, 2, -3}, {2, 2, -4}, {-4, 3, 1}, {-3, 3, 0},
+    {-2, 3, -1}, {-1, 3, -2}, {0, 3, -3}, {1, 3, -4}, {-4, 4, 0}, {-3, 4, -1}, {-2, 4, -2},
+    {-1, 4, -3}, {0, 4, -4},
+};
+
+static const u8 cell_slot[CELL_COUNT] = {
+    4, 5, 6, 7, 8, 12, 13, 14, 15, 16, 17, 20, 21, 22, 23, 24, 25, 26, 28, 29, 30, 31, 32, 33, 34,
+    35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 54, 55, 56, 57, 58, 59,
+    60, 63, 64, 65, 66, 67, 68, 72, 73, 74, 75, 76,
+};
+
+static const u8 slot_cell[81] = {
+    CELL_NONE, CELL_NONE, CELL_NONE, CELL_NONE, 0, 1, 2, 3, 4, CELL_NONE, CELL_NONE, CELL_NONE, 5,
+    6, 7, 8, 9, 10, CELL_NONE, CELL_NONE, 11, 12, 13, 14, 15, 16, 17, CELL_NONE, 18, 19, 20, 21, 22,
+    23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, CELL_NONE, 43,
+    44, 45, 46, 47, 48, 49, CELL_NONE, CELL_NONE, 50, 51, 52, 53, 54, 55, CELL_NONE, CELL_NONE,
+    CELL_NONE, 56, 57, 58, 59, 60, CELL_NONE, CELL_NONE, CELL_NONE, CELL_NONE,
+};
+
+static const u8 cell_neighbors[CELL_COUNT][6] = {
+    {CELL_NONE, 1, 6, 5, CELL_NONE, CELL_NONE}, {CELL_NONE, 2, 7, 6, 0, CELL_NONE},
+    {CELL_NONE, 3, 8, 7, 1, CELL_NONE}, {CELL_NONE, 4, 9, 8, 2, CELL_NONE},
+    {CELL_NONE, CELL_NONE, 10, 9, 3, CELL_NONE}, {0, 6, 12, 11, CELL_NONE, CELL_NONE},
+    {1, 7, 13, 12, 5, 0}, {2, 8, 14, 13, 6, 1}, {3, 9, 15, 14, 7, 2}, {4, 10, 16, 15, 8, 3},
+    {CELL_NONE, CELL_NONE, 17, 16, 9, 4}, {5, 12, 19, 18, CELL_NONE, CELL_NONE},
+    {6, 13, 20, 19, 11, 5}, {7, 14, 21, 20, 12, 6}, {8, 15, 22, 21, 13, 7}, {9, 16, 23, 22, 14, 8},
+    {10, 17, 24, 23, 15, 9}, {CELL_NONE, CELL_NONE, 25, 24, 16, 10},
+    {11, 19, 27, 26, CELL_NONE, CELL_NONE}, {12, 20, 28, 27, 18, 11}, {13, 21, 29, 28, 19, 12},
+    {14, 22, 30, 29, 20, 13}, {15, 23, 31, 30, 21, 14}, {16, 24, 32, 31, 22, 15},
+    {17, 25, 33, 32, 23, 16}, {CELL_NONE, CELL_NONE, 34, 33, 24, 17},
+    {18, 27, 35, CELL_NONE, CELL_NONE, CELL_NONE}, {19, 28, 36, 35, 26, 18},
+    {20, 29, 37, 36, 27, 19}, {21, 30, 38, 37, 28, 20}, {22, 31, 39, 38, 29, 21},
+    {23, 32, 40, 39, 30, 22}, {24, 33, 41, 40, 31, 23}, {25, 34, 42, 41, 32, 24},
+    {CELL_NONE, CELL_NONE, CELL_NONE, 42, 33, 25}, {27, 36, 43, CELL_NONE, CELL_NONE, 26},
+    {28, 37, 44, 43, 35, 27}, {29, 38, 45, 44, 36, 28}, {30, 39, 46, 45, 37, 29},
+    {31, 40, 47, 46, 38, 30}, {32, 41, 48, 47, 39, 31}, {33, 42, 49, 48, 40, 32},
+    {34, CELL_NONE, CELL_NONE, 49, 41, 33}, {36, 44, 50, CELL_NONE, CELL_NONE, 35},
+    {37, 45, 51, 50, 43, 36}, {38, 46, 52, 51, 44, 37}, {39, 47, 53, 52, 45, 38},
+    {40, 48, 54, 53, 46, 39}, {41, 49, 55, 54, 47, 40}, {42, CELL_NONE, CELL_NONE, 55, 48, 41},
+    {44, 51, 56, CELL_NONE, CELL_NONE, 43}, {45, 52, 57, 56, 50, 44}, {46, 53, 58, 57, 51, 45},
+    {47, 54, 59, 58, 52, 46}, {48, 55, 60, 59, 53, 47}, {49, CELL_NONE, CELL_NONE, 60, 54, 48},
+    {51, 57, CELL_NONE, CELL_NONE, CELL_NONE, 50}, {52, 58, CELL_NONE, CELL_NONE, 56, 51},
+    {53, 59, CELL_NONE, CELL_NONE, 57, 52}, {54, 60, CELL_NONE, CELL_NONE, 58, 53},
+    {55, CELL_NONE, CELL_NONE, CELL_NONE, 59, 54},
+};
+
+// Tiles within 2 steps of each cell, not including the cell itself. What a bow can volley.
+static const BitBoard cell_ring[CELL_COUNT] = {
+    {0x0000000000707060ull, 0x0000000000000000ull},
+    {0x0000000000e0f0d0ull, 0x0000000000000000ull},
+    {0x0000000001c1e1b0ull, 0x0000000000000000ull},
+    {0x000000000383c160ull, 0x0000000000000000ull},
+    {0x00000000070380c0ull, 0x0000000000000000ull},
+    {0x0000000070706030ull, 0x0000000000000000ull},
+    {0x00000000e0f0d070ull, 0x0000000000000000ull},
+    {0x00000001c1e1b0f0ull, 0x0000000000000000ull},
+    {0x0000000383c361e0ull, 0x0000000000000000ull},
+    {0x000000070782c1c0ull, 0x0000000000000000ull},
+    {0x0000000e07018180ull, 0x0000000000000000ull},
+    {0x0000007070603010ull, 0x0000000000000000ull},
+    {0x000000e0f0d07030ull, 0x0000000000000000ull},
+    {0x000001c1e1b0f070ull, 0x0000000000000000ull},
+    {0x00000383c361e0e0ull, 0x0000000000000000ull},
+    {0x0000070786c3c1c0ull, 0x0000000000000000ull},
+    {0x00000e0f05838180ull, 0x0000000000000000ull},
+    {0x00001c0e03030100ull, 0x0000000000000000ull},
+    {0x0000607060301000ull, 0x0000000000000000ull},
+    {0x0000e0f0d0703000ull, 0x0000000000000000ull},
+    {0x0001c1e1b0f07000ull, 0x0000000000000000ull},
+    {0x000383c361e0e000ull, 0x0000000000000000ull},
+    {0x00070786c3c1c000ull, 0x0000000000000000ull},
+    {0x000e0f0d87838000ull, 0x0000000000000000ull},
+    {0x001c1e0b07030000ull, 0x0000000000000000ull},
+    {0x00181c0606020000ull, 0x0000000000000000ull},
+    {0x0040606030100000ull, 0x0000000000000000ull},
+    {0x00c0e0d070300000ull, 0x0000000000000000ull},
+    {0x01c1e1b0f0700000ull, 0x0000000000000000ull},
+    {0x0383c361e0e00000ull, 0x0000000000000000ull},
+    {0x070786c3c1c00000ull, 0x0000000000000000ull},
+    {0x0e0f0d8783800000ull, 0x0000000000000000ull},
+    {0x1c1e1b0f07000000ull, 0x0000000000000000ull},
+    {0x181c160e06000000ull, 0x0000000000000000ull},
+    {0x10180c0c04000000ull, 0x0000000000000000ull},
+    {0x80c0c07030000000ull, 0x0000000000000000ull},
+    {0x81c1a0f070000000ull, 0x0000000000000001ull},
+    {0x83c361e0e0000000ull, 0x0000000000000003ull},
+    {0x0786c3c1c0000000ull, 0x0000000000000007ull},
+    {0x0f0d878380000000ull, 0x000000000000000eull},
+    {0x1e1b0f0700000000ull, 0x000000000000001cull},
+    {0x1c161e0e00000000ull, 0x0000000000000018ull},
+    {0x180c1c0c00000000ull, 0x0000000000000010ull},
+    {0x8180e07000000000ull, 0x0000000000000101ull},
+    {0x8341e0e000000000ull, 0x0000000000000303ull},
+    {0x86c3c1c000000000ull, 0x0000000000000707ull},
+    {0x0d87838000000000ull, 0x0000000000000e0full},
+    {0x1b0f070000000000ull, 0x0000000000001c1eull},
+    {0x161e0e0000000000ull, 0x000000000000181cull},
+    {0x0c1c1c0000000000ull, 0x0000000000001018ull},
+    {0x01c0e00000000000ull, 0x0000000000000303ull},
+    {0x83c1c00000000000ull, 0x0000000000000706ull},
+    {0x8783800000000000ull, 0x0000000000000f0dull},
+    {0x0f07000000000000ull, 0x0000000000001e1bull},
+    {0x1e0e000000000000ull, 0x0000000000001c16ull},
+    {0x1c1c000000000000ull, 0x000000000000180cull},
+    {0x81c0000000000000ull, 0x0000000000000603ull},
+    {0x8380000000000000ull, 0x0000000000000d07ull},
+    {0x0700000000000000ull, 0x0000000000001b0full},
+    {0x0e00000000000000ull, 0x000000000000161eull},
+    {0x1c00000000000000ull, 0x0000000000000c1cull},
+};
+
+u8 cpos_cell(CPos pos) {
+    return slot_cell[cpos_index(pos)];
+}
+
+static CPos cpos_from_index(size_t i) {
+    assert(slot_cell[i] != CELL_NONE);
+    return cell_cpos[slot_cell[i]];
+}
+
+const i32 piece_material[8] = {
+    [PIECE_NULL] = 0, [PIECE_EMPTY] = 0, [PIECE_CROWN] = 7,
+    [PIECE_PIKE] = 1, [PIECE_HORSE] = 5, [PIECE_BOW] = 3,
+};
+
+// Board kernels. They scan a copy of the board padded with TILE_NULL to a whole number of
+// vectors, 16 bytes a step or 32 with AVX2.
+#define BOARD_PADDED 96
+
+#ifdef SIMD_AVX2
+#define SIMD_WIDTH 32
+#else
+#define SIMD_WIDTH 16
+#endif
+
+// Bit i set when (p[i] & mask) == value, for the SIMD_WIDTH bytes at p.
+static u32 simd_match(const u8 *p, u8 mask, u8 value) {
+#if defined(SIMD_AVX2)
+    __m256i v =
+        _mm256_and_si256(_mm256_load_si256((const __m256i *)p), _mm256_set1_epi8((char)mask));
+    return (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)value)));
+#elif defined(SIMD_SSE2)
+    __m128i v = _mm_and_si128(_mm_load_si128((const __m128i *)p), _mm_set1_epi8((char)mask));
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)value)));
+#elif defined(SIMD_NEON)
+    // No movemask, weight each matching byte by its bit and add up each half.
+    static const u8 bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t v = vandq_u8(vld1q_u8(p), vdupq_n_u8(mask));
+    uint8x16_t m = vandq_u8(vceqq_u8(v, vdupq_n_u8(value)), vld1q_u8(bits));
+    return (u32)vaddv_u8(vget_low_u8(m)) | (u32)vaddv_u8(vget_high_u8(m)) << 8;
+#elif defined(SIMD_WASM)
+    v128_t v = wasm_v128_and(wasm_v128_load(p), wasm_i8x16_splat((int8_t)mask));
+    return (u32)wasm_i8x16_bitmask(wasm_i8x16_eq(v, wasm_i8x16_splat((int8_t)value)));
+#else
+    u32 bits = 0;
+    for (u32 i = 0; i < SIMD_WIDTH; i++) {
+        bits |= (u32)((p[i] & mask) == value) << i;
+    }
+    return bits;
+#endif
+}
+
+static BitBoard board_match(const u8 *padded, u8 mask, u8 value) {
+    BitBoard bb = {0, 0};
+    for (u32 i = 0; i < BOARD_PADDED; i += SIMD_WIDTH) {
+        u64 bits = simd_match(padded + i, mask, value);
+        if (i < 64) {
+            bb.lo |= bits << i;
+        } else {
+            bb.hi |= bits << (i - 64);
+        }
+    }
+    // The padding is TILE_NULL and can match too.
+    bb.hi &= ((u64)1 << (81 - 64)) - 1;
+    return bb;
+}
+
+// Sum of `weights[tile & 0xF]` over the board, a byte shuffle looks the weights up 16 tiles at a
+// time. Weights and their sum over a row of tiles fit in a byte.
+static u32 board_weigh(const u8 *padded, const u8 weights[16]) {
+    u32 sum = 0;
+#if defined(SIMD_AVX2)
+    __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)weights));
+    __m256i acc = _mm256_setzero_si256();
+    for (u32 i = 0; i < BOARD_PADDED; i += 32) {
+        __m256i v = _mm256_and_si256(_mm256_load_si256((const __m256i *)(padded + i)),
+                                     _mm256_set1_epi8(0x0F));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_shuffle_epi8(table, v),
+                                                    _mm256_setzero_si256()));
+    }
+    sum = (u32)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+#elif defined(SIMD_SSE2) && defined(__SSSE3__)
+    __m128i table = _mm_loadu_si128((const __m128i *)weights);
+    __m128i acc = _mm_setzero_si128();
+    for (u32 i = 0; i < BOARD_PADDED; i += 16) {
+        __m128i v =
+            _mm_and_si128(_mm_load_si128((const __m128i *)(padded + i)), _mm_set1_epi8(0x0F));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_shuffle_epi8(table, v), _mm_setzero_si128()));
+    }
+    sum = (u32)_mm_cvtsi128_si32(acc) + (u32)_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#elif defined(SIMD_NEON)
+    uint8x16_t table = vld1q_u8(weights);
+    for (u32 i = 0; i < BOARD_PADDED; i += 16) {
+        uint8x16_t v = vandq_u8(vld1q_u8(padded + i), vdupq_n_u8(0x0F));
+        sum += vaddlvq_u8(vqtbl1q_u8(table, v));
+    }
+#elif defined(SIMD_WASM)
+    v128_t table = wasm_v128_load(weights);
+    v128_t acc = wasm_i32x4_splat(0);
+    for (u32 i = 0; i < BOARD_PADDED; i += 16) {
+        v128_t v = wasm_v128_and(wasm_v128_load(padded + i), wasm_i8x16_splat(0x0F));
+        v128_t w = wasm_i8x16_swizzle(table, v);
+        acc = wasm_i32x4_add(acc, wasm_u32x4_extadd_pairwise_u16x8(
+                                      wasm_u16x8_extadd_pairwise_u8x16(w)));
+    }
+    sum = wasm_u32x4_extract_lane(acc, 0) + wasm_u32x4_extract_lane(acc, 1) +
+          wasm_u32x4_extract_lane(acc, 2) + wasm_u32x4_extract_lane(acc, 3);
+#else
+    for (u32 i = 0; i < BOARD_PADDED; i++) {
+        sum += weights[padded[i] & 0x0F];
+    }
+#endif
+    return sum;
+}
+
+static u8 bb_count(BitBoard a) {
+    return (u8)(__builtin_popcountll(a.lo) + __builtin_popcountll(a.hi));
+}
+
+void game_compute_bitboards(Game *game) {
+    _Alignas(32) u8 padded[BOARD_PADDED] = {0};
+    memcpy(padded, game->board, sizeof(game->board));
+
+    BitBoard null = board_match(padded, 0xFF, TILE_NULL);
+    BitBoard empty = board_match(padded, PIECE_KIND_MASK, PIECE_EMPTY);
+    game->cells = (BitBoard){~null.lo, ~null.hi & (((u64)1 << (81 - 64)) - 1)};
+    game->players[0] = bb_andnot(board_match(padded, PLAYER_MASK, PLAYER_RED), bb_or(null, empty));
+    game->players[1] = bb_andnot(board_match(padded, PLAYER_MASK, PLAYER_BLUE), empty);
+    game->kinds[PIECE_NULL] = (BitBoard){0, 0};
+    for (u8 kind = PIECE_PIKE; kind <= PIECE_CROWN; kind++) {
+        game->kinds[kind] = board_match(padded, PIECE_KIND_MASK, kind);
+        for (size_t p = 0; p < 2; p++) {
+            game->piece_counts[p][kind] = bb_count(bb_and(game->kinds[kind], game->players[p]));
+        }
+    }
+    for (size_t p = 0; p < 2; p++) {
+        game->piece_counts[p][PIECE_NULL] = 0;
+    }
+
+    // Red's and blue's weights by the low nibble of the tile.
+    u8 weights[2][16] = {{0}};
+    for (u8 kind = PIECE_PIKE; kind <= PIECE_CROWN; kind++) {
+        weights[0][PLAYER_RED | kind] = (u8)piece_material[kind];
+        weights[1][PLAYER_BLUE | kind] = (u8)piece_material[kind];
+    }
+    game->material = (i32)board_weigh(padded, weights[0]) - (i32)board_weigh(padded, weights[1]);
+}
+
+// Set a board slot and keep the bitboards and material in sync. Undo goes through here too,
+// so putting the old tiles back restores them.
+static void game_board_set(Game *game, size_t i, u8 tile) {
+    u8 prev = game->board[i];
+    BitBoard bit = bb_bit(i);
+    if (prev != TILE_NULL && prev != TILE_EMPTY) {
+        BitBoard *player = &game->players[PLAYER_INDEX(prev & PLAYER_MASK)];
+        BitBoard *kind = &game->kinds[prev & PIECE_KIND_MASK];
+        *player = bb_andnot(*player, bit);
+        *kind = bb_andnot(*kind, bit);
+        game->piece_counts[PLAYER_INDEX(prev & PLAYER_MASK)][prev & PIECE_KIND_MASK]--;
+        i32 material = piece_material[prev & PIECE_KIND_MASK];
+        game->material -= (prev & PLAYER_MASK) == PLAYER_RED ? material : -material;
+    }
+    if (tile != TILE_NULL && tile != TILE_EMPTY) {
+        BitBoard *player = &game->players[PLAYER_INDEX(tile & PLAYER_MASK)];
+        BitBoard *kind = &game->kinds[tile & PIECE_KIND_MASK];
+        *player = bb_or(*player, bit);
+        *kind = bb_or(*kind, bit);
+        game->piece_counts[PLAYER_INDEX(tile & PLAYER_MASK)][tile & PIECE_KIND_MASK]++;
+        i32 material = piece_material[tile & PIECE_KIND_MASK];
+        game->material += (tile & PLAYER_MASK) == PLAYER_RED ? material : -material;
+    }
+    game->board[i] = tile;
+}
+
+// Zobrist keys are derived on the fly with splitmix64 instead of being stored in tables,
+// there's no init step and nothing to share between threads.
+static u64 hash_mix(u64 x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+#define ZOBRIST_TILE 0x1000000000000000ull
+#define ZOBRIST_TURN 0x2000000000000000ull
+#define ZOBRIST_USED 0x3000000000000000ull
+#define ZOBRIST_ACTIVE 0x4000000000000000ull
+
+// Key for a tile value at a board index, covers the piece id too since activations
+// refer to pieces by their full tile value.
+static u64 zobrist_tile(size_t i, u8 tile) {
+    return hash_mix(ZOBRIST_TILE | (u64)i << 8 | tile);
+}
+
+// Key for the activation state of the turn. Only the parts that change which commands are
+// valid are hashed. Pieces in finished activations are xor'd so the order they were used in
+// doesn't matter, moving A then B is the same position as moving B then A.
+static u64 zobrist_turn(Turn *turn) {
+    u64 key = hash_mix(ZOBRIST_TURN | (u64)turn->player << 8 | turn->activation_i);
+    for (u8 i = 0; i < turn->activation_i && i < 2; i++) {
+        key ^= hash_mix(ZOBRIST_USED | turn->activations[i].piece);
+    }
+    if (turn->activation_i < 2) {
+        Activation *activation = &turn->activations[turn->activation_i];
+        u64 active = (u64)activation->piece | (u64)activation->order_i << 8;
+        for (u8 i = 0; i < activation->order_i && i < 2; i++) {
+            active |= (u64)activation->orders[i].kind << (16 + 8 * i);
+        }
+        key ^= hash_mix(ZOBRIST_ACTIVE | active);
+    }
+    return key;
+}
+
+u64 game_compute_hash(Game *game) {
+    u64 hash = zobrist_turn(&game->turn);
+    for (size_t i = 0; i < 81; i++) {
+        hash ^= zobrist_tile(i, game->board[i]);
+    }
+    return hash;
+}
+
+// Set a tile and keep the hash and bitboards in sync.
+static void game_set_piece(Game *game, CPos pos, u8 tile) {
+    size_t i = cpos_index(pos);
+    game->hash ^= zobrist_tile(i, game->board[i]) ^ zobrist_tile(i, tile);
+    game_board_set(game, i, tile);
+}
+
 u8 piece_pack(Piece piece) {
     assert(piece.id < 16);
     return (u8)(piece.id << 4 | piece.player | piece.kind);
 }
 
+typedef struct {
+    Direction step; // Direction from the previous piece.
+    PieceKind kind;
+    u8 id;
+} Placement;
+
+// Attrition setup, each side is a walk over the board starting at its crown.
+static const Placement attrition_red[11] = {
+    {DIR_RIGHT_UP, PIECE_CROWN, 1}, // Start, not a step.
+    {DIR_RIGHT_UP, PIECE_BOW, 1},
+    {DIR_RIGHT_UP, PIECE_HORSE, 1},
+    {DIR_RIGHT, PIECE_PIKE, 1},
+    {DIR_LEFT_DOWN, PIECE_PIKE, 2},
+    {DIR_LEFT_DOWN, PIECE_BOW, 2},
+    {DIR_RIGHT, PIECE_PIKE, 3},
+    {DIR_LEFT_DOWN, PIECE_PIKE, 4},
+    {DIR_LEFT, PIECE_BOW, 3},
+    {DIR_RIGHT_DOWN, PIECE_HORSE, 2},
+    {DIR_RIGHT, PIECE_PIKE, 5},
+};
+static const Placement attrition_blue[11] = {
+    {DIR_LEFT_UP, PIECE_CROWN, 1}, // Start, not a step.
+    {DIR_LEFT_UP, PIECE_BOW, 1},
+    {DIR_LEFT_UP, PIECE_HORSE, 1},
+    {DIR_LEFT, PIECE_PIKE, 1},
+    {DIR_RIGHT_DOWN, PIECE_PIKE, 2},
+    {DIR_RIGHT_DOWN, PIECE_BOW, 2},
+    {DIR_LEFT, PIECE_PIKE, 3},
+    {DIR_RIGHT_DOWN, PIECE_PIKE, 4},
+    {DIR_RIGHT, PIECE_BOW, 3},
+    {DIR_LEFT_DOWN, PIECE_HORSE, 2},
+    {DIR_LEFT, PIECE_PIKE, 5},
+};
+
+static void place_pieces(Game *game, Player player, CPos start, const Placement *placements,
+                         size_t count) {
+    u8 cell = slot_cell[cpos_index(start)];
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            cell = cell_neighbors[cell][placements[i].step];
+        }
+        assert(cell != CELL_NONE);
+        game->board[cell_slot[cell]] = piece_pack((Piece){
+            .kind = placements[i].kind,
+            .player = player,
+            .id = placements[i].id,
+        });
+    }
+}
+
 void game_init(Game *game, GameMode game_mode, Map map) {
     UNUSED(game_mode);
     UNUSED(map);
@@ -177,152 +756,13 @@ void game_init(Game *game, GameMode game_mode, Map map) {
     }
 
     // @note: Hardcoded to "Hex Field Small".
-    for (i32 q = -4; q <= 4; q++) {
-        for (i32 r = -4; r <= 4; r++) {
-            for (i32 s = -4; s <= 4; s++) {
-                if (q + r + s != 0) {
-                    continue;
-                }
-                CPos cpos = {q, r, s};
-                *game_piece(game, cpos) = TILE_EMPTY;
-            }
-        }
+    for (size_t cell = 0; cell < CELL_COUNT; cell++) {
+        game->board[cell_slot[cell]] = TILE_EMPTY;
     }
 
     // @note: Hardcoded to "attrition" on "Hex Field Small".
-
-    CPos p = (CPos){-4, 0, 4};
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_CROWN,
-        .player = PLAYER_RED,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_RIGHT_UP);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_RED,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_RIGHT_UP);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_HORSE,
-        .player = PLAYER_RED,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_RIGHT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_RED,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_LEFT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_RED,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_LEFT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_RED,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_RIGHT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_RED,
-        .id = 3,
-    });
-    p = cpos_add(p, CPOS_LEFT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_RED,
-        .id = 4,
-    });
-    p = cpos_add(p, CPOS_LEFT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_RED,
-        .id = 3,
-    });
-    p = cpos_add(p, CPOS_RIGHT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_HORSE,
-        .player = PLAYER_RED,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_RIGHT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_RED,
-        .id = 5,
-    });
-    p = (CPos){4, 0, -4};
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_CROWN,
-        .player = PLAYER_BLUE,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_LEFT_UP);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_BLUE,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_LEFT_UP);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_HORSE,
-        .player = PLAYER_BLUE,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_LEFT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_BLUE,
-        .id = 1,
-    });
-    p = cpos_add(p, CPOS_RIGHT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_BLUE,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_RIGHT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_BLUE,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_LEFT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_BLUE,
-        .id = 3,
-    });
-    p = cpos_add(p, CPOS_RIGHT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_BLUE,
-        .id = 4,
-    });
-    p = cpos_add(p, CPOS_RIGHT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_BOW,
-        .player = PLAYER_BLUE,
-        .id = 3,
-    });
-    p = cpos_add(p, CPOS_LEFT_DOWN);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_HORSE,
-        .player = PLAYER_BLUE,
-        .id = 2,
-    });
-    p = cpos_add(p, CPOS_LEFT);
-    *game_piece(game, p) = piece_pack((Piece){
-        .kind = PIECE_PIKE,
-        .player = PLAYER_BLUE,
-        .id = 5,
-    });
+    place_pieces(game, PLAYER_RED, (CPos){-4, 0, 4}, attrition_red, 11);
+    place_pieces(game, PLAYER_BLUE, (CPos){4, 0, -4}, attrition_blue, 11);
 
     game->status = STATUS_IN_PROGRESS;
 
@@ -336,14 +776,59 @@ void game_init(Game *game, GameMode game_mode, Map map) {
         game->turn.activations[i].order_i = 0;
     }
     game->turn.activation_i = 1; // @note: Special case for attrition.
+
+    game->hash = game_compute_hash(game);
+    game_compute_bitboards(game);
 }
 
-#if 0
+// @todo: Compare muster_piece_kind when muster is implemented.
 bool command_eq(Command *a, Command *b) {
     return a->kind == b->kind && cpos_eq(a->piece_pos, b->piece_pos) &&
-           cpos_eq(a->target_pos, b->target_pos) && a->muster_piece_kind == b->muster_piece_kind;
+           cpos_eq(a->target_pos, b->target_pos);
+}
+
+void command_format(Command command, char *buf, size_t size) {
+    CPos from = command.piece_pos;
+    CPos to = command.target_pos;
+    switch (command.kind) {
+    case COMMAND_MOVE:
+    case COMMAND_VOLLEY:
+        snprintf(buf, size, "%d,%d,%d%c%d,%d,%d", from.q, from.r, from.s,
+                 command.kind == COMMAND_MOVE ? '>' : 'x', to.q, to.r, to.s);
+        break;
+    case COMMAND_END_TURN:
+        snprintf(buf, size, "end");
+        break;
+    default:
+        snprintf(buf, size, "none");
+        break;
+    }
+}
+
+bool command_parse(const char *text, Command *command) {
+    if (strcmp(text, "end") == 0) {
+        *command = (Command){.kind = COMMAND_END_TURN};
+        return true;
+    }
+    CPos from;
+    CPos to;
+    char kind;
+    int end = 0;
+    int parsed = sscanf(text, "%d,%d,%d%c%d,%d,%d%n", &from.q, &from.r, &from.s, &kind, &to.q,
+                        &to.r, &to.s, &end);
+    if (parsed != 7 || text[end] != '\0' || (kind != '>' && kind != 'x')) {
+        return false;
+    }
+    if (from.q + from.r + from.s != 0 || to.q + to.r + to.s != 0) {
+        return false;
+    }
+    *command = (Command){
+        .kind = kind == '>' ? COMMAND_MOVE : COMMAND_VOLLEY,
+        .piece_pos = from,
+        .target_pos = to,
+    };
+    return true;
 }
-#endif
 
 static i32 piece_movement(PieceKind kind) {
     switch (kind) {
@@ -452,49 +937,27 @@ typedef struct {
 // Check the 18 tiles around the piece for other players pieces.
 static size_t volley_targets(CPosBuf *target_buf, Game *game, CPos from) {
     assert(target_buf->cap >= 18);
-    size_t num_targets = 0;
-    u8 piece = *game_piece(game, from);
-
-    for (i32 r = -2; r <= 2; r++) {
-        for (i32 q = -2; q <= 2; q++) {
-            for (i32 s = -2; s <= 2; s++) {
-                if (q + r + s != 0) {
-                    continue;
-                }
-                CPos offset = {q, r, -q - r};
-
-                // Can't shoot yourself.
-                if (cpos_eq(offset, (CPos){0, 0, 0})) {
-                    continue;
-                }
+    size_t from_i = cpos_index(from);
+    u8 piece = game->board[from_i];
 
-                CPos cpos = cpos_add(from, offset);
-                u8 target_piece = *game_piece(game, cpos);
-                if (target_piece == TILE_NULL || target_piece == TILE_EMPTY) {
-                    continue;
-                }
+    BitBoard enemies = game->players[PLAYER_INDEX(piece & PLAYER_MASK) ^ 1];
+    BitBoard targets = bb_and(cell_ring[slot_cell[from_i]], enemies);
 
-                if ((target_piece & PLAYER_MASK) != (piece & PLAYER_MASK)) {
-                    assert(num_targets == target_buf->count);
-                    assert(target_buf->count < target_buf->cap);
-                    target_buf->targets[num_targets] = cpos;
-                    target_buf->count++;
-                    num_targets++;
-                    assert(target_buf->count == num_targets);
-                }
-            }
-        }
+    size_t num_targets = 0;
+    while (!bb_empty(targets)) {
+        assert(num_targets < target_buf->cap);
+        target_buf->targets[num_targets++] = cpos_from_index(bb_pop(&targets));
     }
-    assert(num_targets == target_buf->count);
-    assert(target_buf->count <= target_buf->cap);
+    target_buf->count = num_targets;
     return num_targets;
 }
 
-// Walk in all directions from the piece and add all valid targets to the buffer.
+// Flood fill out from the piece one step at a time and add all valid targets to the buffer.
 static size_t move_targets(CPosBuf *targets_buf, Game *game, CPos from) {
     assert(targets_buf->cap >= 64);
 
-    u8 piece = *game_piece(game, from);
+    size_t from_i = cpos_index(from);
+    u8 piece = game->board[from_i];
     PieceKind kind = piece & PIECE_KIND_MASK;
     assert(piece != 0);
 
@@ -508,70 +971,35 @@ static size_t move_targets(CPosBuf *targets_buf, Game *game, CPos from) {
     // @todo: Pending response from the bros, max_strength for crown might be 0
     //       if it can kill another crown.
 
-    CPos visited[64];
-    size_t visited_count = 0;
-    visited[visited_count++] = from;
-
-    size_t i = 0;
-    for (i32 steps = 0; steps < movement; steps++) {
-        for (size_t current_count = visited_count; i < current_count; i++) {
-            CPos current = visited[i];
+    BitBoard enemies = game->players[PLAYER_INDEX(piece & PLAYER_MASK) ^ 1];
+    BitBoard empty = bb_andnot(game->cells, bb_or(game->players[0], game->players[1]));
 
-            // Don't continue moving through another piece.
-            u8 current_piece = *game_piece(game, current);
-            if (i > 0 && current_piece != TILE_EMPTY) {
-                continue;
-            }
-
-            // Check neighboring tiles.
-            CPos neighbors[6] = {
-                cpos_add(current, CPOS_RIGHT_UP),   cpos_add(current, CPOS_RIGHT),
-                cpos_add(current, CPOS_RIGHT_DOWN), cpos_add(current, CPOS_LEFT_DOWN),
-                cpos_add(current, CPOS_LEFT),       cpos_add(current, CPOS_LEFT_UP),
-            };
-            for (size_t n = 0; n < 6; n++) {
-                CPos neighbor = neighbors[n];
-                // Skip if we've already checked this neighbor.
-                bool already_checked = false;
-                for (size_t ii = 0; ii < visited_count; ii++) {
-                    if (cpos_eq(visited[ii], neighbor)) {
-                        already_checked = true;
-                        break;
-                    }
-                }
-                if (already_checked) {
-                    continue;
-                }
-                // Don't step off the board.
-                u8 neighbor_piece = *game_piece(game, neighbor);
-                if (neighbor_piece == 0) {
-                    continue;
-                }
-                if (neighbor_piece != TILE_EMPTY) {
-                    // Don't move into a tile with a piece of the same player.
-                    if ((neighbor_piece & PLAYER_MASK) == (piece & PLAYER_MASK)) {
-                        continue;
-                    }
-                    // If neighbor is occupied by a piece, don't move there if we
-                    // can't kill it.
-                    if (piece_strength(neighbor_piece & PIECE_KIND_MASK) > max_strength) {
-                        continue;
-                    }
-                }
-                // We can move here.
-                visited[visited_count++] = neighbor;
-            }
+    // Tiles we can step into, empty ones and enemy pieces we can kill.
+    BitBoard open = empty;
+    for (PieceKind k = PIECE_PIKE; k <= PIECE_CROWN; k++) {
+        if (piece_strength(k) <= max_strength) {
+            open = bb_or(open, bb_and(game->kinds[k], enemies));
         }
     }
 
-    // Copy results to targets_buf.
-    // Skip the first target since it's the starting position.
-    assert(visited_count <= targets_buf->cap);
-    targets_buf->count = visited_count - 1;
-    for (size_t visited_i = 1; visited_i < visited_count; visited_i++) {
-        targets_buf->targets[visited_i - 1] = visited[visited_i];
+    BitBoard frontier = bb_bit(from_i);
+    BitBoard visited = frontier;
+    BitBoard reached = {0, 0};
+    for (i32 steps = 0; steps < movement && !bb_empty(frontier); steps++) {
+        BitBoard next = bb_andnot(bb_and(bb_neighbors(frontier, game->cells), open), visited);
+        reached = bb_or(reached, next);
+        visited = bb_or(visited, next);
+        // Don't continue moving through another piece.
+        frontier = bb_and(next, empty);
+    }
+
+    size_t num_targets = 0;
+    while (!bb_empty(reached)) {
+        assert(num_targets < targets_buf->cap);
+        targets_buf->targets[num_targets++] = cpos_from_index(bb_pop(&reached));
     }
-    return visited_count - 1;
+    targets_buf->count = num_targets;
+    return num_targets;
 }
 
 void push_command(CommandBuf *command_buf, Command command) {
@@ -602,69 +1030,56 @@ void game_valid_commands(CommandBuf *command_buf, Game *game) {
                                   .target_pos = (CPos){0, 0, 0},
                               });
 
-    for (i32 q = -4; q <= 4; q++) {
-        for (i32 r = -4; r <= 4; r++) {
-            for (i32 s = -4; s <= 4; s++) {
-                if (q + r + s != 0) {
-                    continue;
-                }
-                CPos cpos = {q, r, s};
-                u8 piece = *game_piece(game, cpos);
-
-                if (piece == TILE_NULL || piece == TILE_EMPTY) {
-                    continue;
-                }
-
-                // Can't use another player's piece.
-                if ((piece & PLAYER_MASK) != game->turn.player) {
-                    continue;
-                }
-
-                AllowedOrderKinds piece_order_kinds = piece_allowed_order_kinds(game, piece);
-                if (piece_order_kinds.piece_can_move) {
-                    CPos targets[64];
-                    CPosBuf targets_buf = {
-                        .targets = &(targets[0]),
-                        .count = 0,
-                        .cap = 64,
-                    };
-                    size_t targets_count = move_targets(&targets_buf, game, cpos);
-                    assert(targets_count <= 64);
-                    assert(targets_count == targets_buf.count);
-                    for (size_t i = 0; i < targets_count; i++) {
-                        CPos target = targets[i];
-                        push_command(command_buf, (Command){
-                                                      .kind = COMMAND_MOVE,
-                                                      .piece_pos = cpos,
-                                                      .target_pos = target,
-                                                  });
-                    }
-                }
-                if (piece_order_kinds.piece_can_action) {
-                    if ((piece & PIECE_KIND_MASK) == PIECE_BOW) {
-                        CPos targets[18];
-                        CPosBuf targets_buf = {
-                            .targets = &(targets[0]),
-                            .count = 0,
-                            .cap = 18,
-                        };
-                        size_t targets_count = volley_targets(&targets_buf, game, cpos);
-                        assert(targets_count <= 18);
-                        assert(targets_count == targets_buf.count);
-                        for (size_t i = 0; i < targets_count; i++) {
-                            CPos target = targets[i];
-                            push_command(command_buf, (Command){
-                                                          .kind = COMMAND_VOLLEY,
-                                                          .piece_pos = cpos,
-                                                          .target_pos = target,
-                                                      });
-                        }
-                    } else if ((piece & PIECE_KIND_MASK) == PIECE_CROWN) {
-                        // @todo: Implement muster.
-                    } else {
-                        assert(false);
-                    }
+    // Only walk the current player's pieces.
+    BitBoard pieces = game->players[PLAYER_INDEX(game->turn.player)];
+    while (!bb_empty(pieces)) {
+        size_t piece_i = bb_pop(&pieces);
+        CPos cpos = cpos_from_index(piece_i);
+        u8 piece = game->board[piece_i];
+
+        AllowedOrderKinds piece_order_kinds = piece_allowed_order_kinds(game, piece);
+        if (piece_order_kinds.piece_can_move) {
+            CPos targets[64];
+            CPosBuf targets_buf = {
+                .targets = &(targets[0]),
+                .count = 0,
+                .cap = 64,
+            };
+            size_t targets_count = move_targets(&targets_buf, game, cpos);
+            assert(targets_count <= 64);
+            assert(targets_count == targets_buf.count);
+            for (size_t i = 0; i < targets_count; i++) {
+                CPos target = targets[i];
+                push_command(command_buf, (Command){
+                                              .kind = COMMAND_MOVE,
+                                              .piece_pos = cpos,
+                                              .target_pos = target,
+                                          });
+            }
+        }
+        if (piece_order_kinds.piece_can_action) {
+            if ((piece & PIECE_KIND_MASK) == PIECE_BOW) {
+                CPos targets[18];
+                CPosBuf targets_buf = {
+                    .targets = &(targets[0]),
+                    .count = 0,
+                    .cap = 18,
+                };
+                size_t targets_count = volley_targets(&targets_buf, game, cpos);
+                assert(targets_count <= 18);
+                assert(targets_count == targets_buf.count);
+                for (size_t i = 0; i < targets_count; i++) {
+                    CPos target = targets[i];
+                    push_command(command_buf, (Command){
+                                                  .kind = COMMAND_VOLLEY,
+                                                  .piece_pos = cpos,
+                                                  .target_pos = target,
+                                              });
                 }
+            } else if ((piece & PIECE_KIND_MASK) == PIECE_CROWN) {
+                // @todo: Implement muster.
+            } else {
+                assert(false);
             }
         }
     }
@@ -688,24 +1103,9 @@ void game_end_turn(Game *game, Player player, Command command) {
         game->turn.activation_i = 0;
     }
 
-    // Check for game over.
-    // @opt: If this is still slow, I can just watch for crown kills during update.
-    i32 red_crowns = 0;
-    i32 blue_crowns = 0;
-    for (u32 i = 0; i < 81; i++) {
-        u8 p = game->board[i];
-        if ((p & PIECE_KIND_MASK) == PIECE_CROWN) {
-            if ((p & PLAYER_MASK) == PLAYER_RED) {
-                red_crowns++;
-            } else if ((p & PLAYER_MASK) == PLAYER_BLUE) {
-                blue_crowns++;
-            }
-        }
-        if (red_crowns > 0 && blue_crowns > 0) {
-            break;
-        }
-    }
-
+    // Check for game over. The crown counts are kept up to date as pieces are taken.
+    u8 red_crowns = game->piece_counts[PLAYER_INDEX(PLAYER_RED)][PIECE_CROWN];
+    u8 blue_crowns = game->piece_counts[PLAYER_INDEX(PLAYER_BLUE)][PIECE_CROWN];
     if (red_crowns == 0) {
         game->status = STATUS_OVER;
         game->winner = PLAYER_BLUE;
@@ -719,6 +1119,9 @@ UndoCommand game_apply_command(Game *game, Player player, Command command,
                                VolleyResult volley_result) {
     UndoCommand undo = {
         .prev_turn = game->turn,
+        .prev_hash = game->hash,
+        .prev_status = game->status,
+        .prev_winner = game->winner,
         .prev_pieces = {0, 0},
         .prev_pieces_pos = {{0, 0, 0}, {0, 0, 0}},
         .prev_pieces_count = 0,
@@ -728,14 +1131,17 @@ UndoCommand game_apply_command(Game *game, Player player, Command command,
         return undo;
     }
 
+    u64 prev_turn_key = zobrist_turn(&game->turn);
+
     if (command.kind == COMMAND_END_TURN) {
         game->turn.activation_i = 2;
         game_end_turn(game, player, command);
+        game->hash ^= prev_turn_key ^ zobrist_turn(&game->turn);
         return undo;
     }
 
-    u8 *piece = game_piece(game, command.piece_pos);
-    u8 *target_piece = game_piece(game, command.target_pos);
+    u8 *piece = &game->board[cpos_index(command.piece_pos)];
+    u8 *target_piece = &game->board[cpos_index(command.target_pos)];
 
     undo.prev_pieces[0] = *piece;
     undo.prev_pieces_pos[0] = command.piece_pos;
@@ -791,8 +1197,9 @@ UndoCommand game_apply_command(Game *game, Player player, Command command,
             break;
         }
         case VOLLEY_ROLL: {
-            u32 die_1 = rand_in_range(1, 6);
-            u32 die_2 = rand_in_range(1, 6);
+            // Two six sided dice, rand_in_range's max is exclusive.
+            u32 die_1 = rand_in_range(1, 7);
+            u32 die_2 = rand_in_range(1, 7);
             u32 roll = die_1 + die_2;
             volley_hits = roll < 7;
             break;
@@ -831,18 +1238,125 @@ UndoCommand game_apply_command(Game *game, Player player, Command command,
     }
 
     for (u8 i = 0; i < set_pieces_count; i++) {
-        *game_piece(game, set_pieces_pos[i]) = set_pieces[i];
+        game_set_piece(game, set_pieces_pos[i], set_pieces[i]);
     }
 
     game_end_turn(game, player, command);
+    game->hash ^= prev_turn_key ^ zobrist_turn(&game->turn);
     return undo;
 }
 
 void game_undo_command(Game *game, UndoCommand undo) {
-    game->status = STATUS_IN_PROGRESS;
+    game->status = undo.prev_status;
+    game->winner = undo.prev_winner;
     game->turn = undo.prev_turn;
+    game->hash = undo.prev_hash;
 
     for (u8 i = 0; i < undo.prev_pieces_count; i++) {
-        *game_piece(game, undo.prev_pieces_pos[i]) = undo.prev_pieces[i];
+        game_board_set(game, cpos_index(undo.prev_pieces_pos[i]), undo.prev_pieces[i]);
+    }
+}
+
+static void push_turn_plan(TurnPlanBuf *plan_buf, TurnPlan *plan) {
+    if (plan_buf->count >= plan_buf->capacity) {
+        plan_buf->capacity = plan_buf->capacity == 0 ? 64 : plan_buf->capacity * 2;
+        TurnPlan *new_buf = realloc(plan_buf->plans, plan_buf->capacity * sizeof(TurnPlan));
+        assert(new_buf != NULL);
+        plan_buf->plans = new_buf;
+    }
+    plan_buf->plans[plan_buf->count++] = *plan;
+}
+
+static bool turn_seen_insert_key(u64 *seen, size_t capacity, u64 key) {
+    size_t mask = capacity - 1;
+    for (size_t i = key & mask;; i = (i + 1) & mask) {
+        if (seen[i] == key) {
+            return false;
+        }
+        if (seen[i] == 0) {
+            seen[i] = key;
+            return true;
+        }
+    }
+}
+
+// Add `key` to the positions reached so far, false if it was already there.
+static bool turn_seen_insert(TurnPlanBuf *plan_buf, u64 key) {
+    key = key == 0 ? 1 : key;
+    if ((plan_buf->seen_count + 1) * 2 > plan_buf->seen_capacity) {
+        size_t capacity = plan_buf->seen_capacity == 0 ? 1024 : plan_buf->seen_capacity * 2;
+        u64 *seen = calloc(capacity, sizeof(u64));
+        assert(seen != NULL);
+        for (size_t i = 0; i < plan_buf->seen_capacity; i++) {
+            if (plan_buf->seen[i] != 0) {
+                turn_seen_insert_key(seen, capacity, plan_buf->seen[i]);
+            }
+        }
+        free(plan_buf->seen);
+        plan_buf->seen = seen;
+        plan_buf->seen_capacity = capacity;
+    }
+    bool inserted = turn_seen_insert_key(plan_buf->seen, plan_buf->seen_capacity, key);
+    plan_buf->seen_count += inserted;
+    return inserted;
+}
+
+// Depth first over the commands of the turn. Positions in the middle of the turn are keyed by
+// their hash too, the hash covers the activations so only true transpositions are cut.
+static void game_valid_turns_from(TurnPlanBuf *plan_buf, Game *game, TurnPlan *plan) {
+    assert(plan->count < TURN_PLAN_COMMANDS_MAX);
+    CommandBuf *commands = &plan_buf->commands[plan->count];
+    game_valid_commands(commands, game);
+    Player player = game->turn.player;
+    for (size_t i = 0; i < commands->count; i++) {
+        Command command = commands->commands[i];
+        plan->commands[plan->count++] = command;
+        if (command.kind == COMMAND_VOLLEY) {
+            // Keyed by the position and the volley, the same volley from the same position
+            // is the same chance whichever order led there.
+            u64 key = hash_mix(game->hash ^ 0x9e3779b97f4a7c15ull ^
+                               (cpos_index(command.piece_pos) << 7 |
+                                cpos_index(command.target_pos)));
+            if (turn_seen_insert(plan_buf, key)) {
+                plan->hash = game->hash;
+                push_turn_plan(plan_buf, plan);
+            }
+        } else {
+            UndoCommand undo = game_apply_command(game, player, command, VOLLEY_ROLL);
+            if (turn_seen_insert(plan_buf, game->hash)) {
+                if (game->turn.player != player || game->status != STATUS_IN_PROGRESS) {
+                    plan->hash = game->hash;
+                    push_turn_plan(plan_buf, plan);
+                } else {
+                    game_valid_turns_from(plan_buf, game, plan);
+                }
+            }
+            game_undo_command(game, undo);
+        }
+        plan->count--;
+    }
+}
+
+void game_valid_turns(TurnPlanBuf *plan_buf, Game *game) {
+    plan_buf->count = 0;
+    if (plan_buf->seen != NULL) {
+        memset(plan_buf->seen, 0, plan_buf->seen_capacity * sizeof(u64));
+    }
+    plan_buf->seen_count = 0;
+
+    if (game->status != STATUS_IN_PROGRESS) {
+        return;
+    }
+
+    TurnPlan plan = {.count = 0};
+    game_valid_turns_from(plan_buf, game, &plan);
+}
+
+void turn_plan_buf_free(TurnPlanBuf *plan_buf) {
+    free(plan_buf->plans);
+    for (size_t i = 0; i < TURN_PLAN_COMMANDS_MAX; i++) {
+        free(plan_buf->commands[i].commands);
     }
+    free(plan_buf->seen);
+    *plan_buf = (TurnPlanBuf){0};
 }
@@ -1,6 +1,7 @@
 #ifndef TAZAR_H
 #define TAZAR_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,13 +10,42 @@
 #define UNUSED(x) (void)(x)
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t i16;
 typedef int32_t i32;
+typedef int64_t i64;
 
+// In [min, max).
 u32 rand_in_range(u32 min, u32 max);
 
 double random_prob();
 
+// Seed the calling thread's generator, the same seed replays the same dice.
+void rand_seed(u64 seed);
+
+// Monotonic wall clock in milliseconds.
+double time_now_ms();
+
+// Bump allocator, one malloc up front and then no more heap calls. Everything allocated after
+// a point is released by saving `used` and writing it back.
+typedef struct {
+    u8 *base;
+    size_t capacity;
+    size_t used;
+} Arena;
+
+void arena_init(Arena *arena, size_t capacity);
+
+void arena_free(Arena *arena);
+
+// 16 byte aligned, NULL when the arena is full.
+void *arena_alloc(Arena *arena, size_t size);
+
+#define ARENA_ALLOC_ARRAY(arena, type, count) \
+    ((type *)arena_alloc((arena), sizeof(type) * (count)))
+
 typedef struct {
     i32 x;
     i32 y;
@@ -42,12 +72,20 @@ V2 v2_from_cpos(CPos cpos);
 
 CPos cpos_from_v2(V2 dpos);
 
+// The tiles of the map numbered 0..CELL_COUNT-1, for tables with an entry per tile.
+#define CELL_COUNT 61
+#define CELL_NONE 0xFF // Off the board.
+
+u8 cpos_cell(CPos pos);
+
 typedef enum : u8 {
     PLAYER_RED = 0b00000000,
     PLAYER_BLUE = 0b00001000,
 } Player;
 
 #define PLAYER_MASK 0b00001000
+// 0 for red, 1 for blue.
+#define PLAYER_INDEX(player) ((player) >> 3)
 
 typedef enum : u8 {
     PIECE_NULL = 0b00000000,
@@ -60,6 +98,9 @@ typedef enum : u8 {
 
 #define PIECE_KIND_MASK 0b00000111
 
+// Material value of each piece kind, indexed by PieceKind.
+extern const i32 piece_material[8];
+
 typedef enum : u8 {
     TILE_NULL = 0b00000000,
     TILE_EMPTY = 0b00000111,
@@ -89,6 +130,12 @@ typedef struct {
     u8 id;
 } Piece;
 
+// One bit per board slot, bit i is `board[i]`. 81 slots so it takes two words.
+typedef struct {
+    u64 lo;
+    u64 hi;
+} BitBoard;
+
 typedef enum {
     ORDER_NONE = 0,
     ORDER_MOVE,
@@ -142,12 +189,31 @@ typedef struct {
     Status status;
     Player winner;
     Turn turn;
+    // Zobrist hash of the board, the side to move and the activation state of the turn.
+    // Kept up to date by `game_apply_command` and `game_undo_command`.
+    u64 hash;
+    // Bitboards of the board, also kept in sync with `board`.
+    BitBoard cells;      // Every tile of the map.
+    BitBoard players[2]; // Pieces of each player, indexed by PLAYER_INDEX.
+    BitBoard kinds[5];   // Pieces of each kind, indexed by PieceKind, PIECE_NULL is unused.
+    // Material, kept in sync the same way.
+    u8 piece_counts[2][5]; // Pieces of each player and kind, indexed like `players` and `kinds`.
+    i32 material;          // `piece_material` of red's pieces less blue's.
 } Game;
 
 u8 *game_piece(Game *game, CPos pos);
 
+// Recompute the hash from scratch, `game->hash` should always equal this.
+u64 game_compute_hash(Game *game);
+
+// Rebuild the bitboards and the material from `board`.
+void game_compute_bitboards(Game *game);
+
 void game_init(Game *game, GameMode game_mode, Map map);
 
+// Same position, board, turn and status. Compares the hashes first so it's cheap when they differ.
+bool game_eq(Game *a, Game *b);
+
 typedef enum {
     COMMAND_NONE = 0,
     COMMAND_MOVE,
@@ -169,7 +235,16 @@ typedef struct {
     CPos target_pos;
 } Command;
 
-// bool command_eq(Command *a, Command *b);
+bool command_eq(Command *a, Command *b);
+
+// Commands as single words for the headless tools, "-1,0,1>0,0,0" moves the piece at -1,0,1 to
+// 0,0,0, "-1,0,1x0,0,0" volleys it and "end" ends the turn.
+#define COMMAND_TEXT_MAX 32
+
+void command_format(Command command, char *buf, size_t size);
+
+// Parses what `command_format` writes. Only checks the syntax, not that the command is valid.
+bool command_parse(const char *text, Command *command);
 
 typedef struct {
     Command *commands;
@@ -177,6 +252,10 @@ typedef struct {
     size_t capacity;
 } CommandBuf;
 
+// Most commands valid in any one position, every piece moving to every other cell plus every
+// bow volleying its whole range is still under this. A buffer this big never grows.
+#define COMMANDS_MAX 1024
+
 void game_valid_commands(CommandBuf *command_buf, Game *game);
 
 typedef enum {
@@ -187,6 +266,9 @@ typedef enum {
 
 typedef struct {
     Turn prev_turn;
+    u64 prev_hash;
+    Status prev_status;
+    Player prev_winner;
     u8 prev_pieces[2];
     CPos prev_pieces_pos[2];
     u8 prev_pieces_count;
@@ -197,20 +279,139 @@ UndoCommand game_apply_command(Game *game, Player player, Command command,
 
 void game_undo_command(Game *game, UndoCommand undo);
 
+// A whole turn, the commands one player gives from a position until the turn passes to the
+// other player. A volley ends the plan early, what's left of the turn depends on the dice.
+#define TURN_PLAN_COMMANDS_MAX 5 // Two activations of up to two orders, then END_TURN.
+
+typedef struct {
+    Command commands[TURN_PLAN_COMMANDS_MAX];
+    u8 count;
+    u64 hash; // Of the position after the plan, before the dice if it ends with a volley.
+} TurnPlan;
+
+typedef struct {
+    TurnPlan *plans;
+    size_t count;
+    size_t capacity;
+    // Scratch kept between calls so generating doesn't allocate once it has grown.
+    CommandBuf commands[TURN_PLAN_COMMANDS_MAX];
+    u64 *seen; // Hashes already reached this call, open addressing, 0 is empty.
+    size_t seen_count;
+    size_t seen_capacity;
+} TurnPlanBuf;
+
+// Every distinct turn from `game`. Orders that commute, A then B and B then A, reach the same
+// position and only the first is kept.
+void game_valid_turns(TurnPlanBuf *plan_buf, Game *game);
+
+void turn_plan_buf_free(TurnPlanBuf *plan_buf);
+
 typedef enum {
     AIDIFF_HUMAN = 0,
     AIDIFF_EASY = 1,
     AIDIFF_MEDIUM = 2,
     AIDIFF_HARD = 3,
+    AIDIFF_MCTS = 4,
 } AIDifficulty;
 
+// How the search threads share the work.
+typedef enum {
+    // Every thread searches the whole tree, they only share the transposition table.
+    AI_PARALLEL_LAZY_SMP = 0,
+    // Young Brothers Wait, siblings are split between the threads once the first is searched.
+    AI_PARALLEL_YBWC,
+} AIParallel;
+
+#define AI_MAX_DEPTH 64
+
+// What one `ai_select_command` did, summed over every search thread.
+typedef struct {
+    u64 leaf_evals;   // Nodes scored by `game_value_for_red`, at depth 0 or with the game over.
+    u64 chance_nodes; // Volleys searched as chance nodes.
+    u64 expanded;     // Decision nodes that generated their children.
+    u64 children;     // Children those searched, the rest were cut off.
+    u64 tt_probes;
+    u64 tt_hits;                   // Probes that found the position.
+    u64 cutoffs[AI_MAX_DEPTH + 1]; // Children cut off by alpha >= beta, by remaining depth.
+    double branching;              // Children searched per expanded node.
+    double elapsed_ms;
+    double nps; // AITurn.nodes a second.
+} AIStats;
+
+// Opening book, positions from the attrition start with the command a deep offline search chose
+// for them. Written by tazar_book, see `ai_book_write`. Only AIDIFF_HARD plays from it, the
+// other difficulties would play far above their level.
+typedef struct AIBook AIBook;
+
+typedef struct {
+    u64 hash; // Game.hash of the position.
+    Command command;
+    double score; // For red.
+    u32 depth;    // Of the search that chose the command.
+} AIBookEntry;
+
+// Map the book at `path`, or read it where there's no mmap. NULL if it's missing or not a book.
+AIBook *ai_book_open(const char *path);
+
+void ai_book_close(AIBook *book);
+
+bool ai_book_probe(const AIBook *book, Game *game, AIBookEntry *entry);
+
+// Sorts `entries` by hash and writes them as a book.
+bool ai_book_write(const char *path, AIBookEntry *entries, size_t count);
+
 typedef struct {
     Game game;
     AIDifficulty difficulty;
     void *ai_state; // Pointer to save ai state between turns if the difficulty doesn't change.
+    u32 tt_size_mb; // Size of the transposition table kept in ai_state, 0 for the default.
+    // Search limits, 0 uses the difficulty's default. The search deepens one ply at a time
+    // until the time budget runs out or max_depth is done.
+    u32 time_budget_ms;
+    u32 max_depth;
+    u32 threads; // Search threads including the calling one, 0 uses the difficulty's default.
+    AIParallel parallel;
+    // Search whole turns from `game_valid_turns` a ply at a time instead of single commands.
+    // max_depth then counts turns, single threaded.
+    bool plan_turns;
+    u32 playouts; // MCTS only, playouts per call, 0 searches for the time budget instead.
+    u64 max_nodes; // Stop once the calling thread has searched this many nodes, 0 for no limit.
+    // Search with no limits until stopped, only for what it leaves in ai_state. Run on the
+    // opponent's turn, the search of the reply then finds the transposition table or the MCTS
+    // tree already warm.
+    bool ponder;
+    AIBook *book; // Consulted before searching on AIDIFF_HARD, NULL for none.
+    // Search even where the book or the turn plan has the command, for tazar_book.
+    bool search_always;
     u32 selected_command_i;
+    // Set with selected_command_i.
+    u32 depth_completed; // Deepest iteration that finished.
+    double score;        // Value of the selected command for red, -1 to 1.
+    u64 nodes;           // Nodes searched by every thread, playouts for MCTS.
+    // Answered from the plan an earlier call made for this turn, nothing was searched. Every call
+    // but a ponder plans the rest of its turn, the next calls with the same difficulty and limits
+    // reuse it.
+    bool planned;
+    bool from_book; // Answered from `book`, nothing was searched.
+    AIStats stats;
+    // Set from another thread, see `ai_stop`. The caller clears both before each search.
+    atomic_bool stop;
+    _Atomic u64 best_so_far; // Published as the search goes, see `ai_best_so_far`. 0 for none.
 } AITurn;
 
 int ai_select_command(void *ptr);
 
+// Ask a running `ai_select_command` to stop. It returns soon after with the best command it has.
+void ai_stop(AITurn *ai_turn);
+
+// The best command and score for red of a running `ai_select_command` so far, updated after each
+// iteration. False until it has one.
+bool ai_best_so_far(AITurn *ai_turn, u32 *command_i, double *score);
+
+// Append the result and stats of the last `ai_select_command` to `path` as one line of JSON.
+bool ai_stats_append_json(const char *path, AITurn *ai_turn);
+
+// Free the state `ai_select_command` keeps in `AITurn.ai_state`, joining its search threads.
+void ai_state_free(void *ai_state);
+
 #endif // TAZAR_H
@@ -1,10 +1,23 @@
 #include "tazar.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+#define AI_BOOK_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 double game_value_for_red(Game *game) {
     if (game->status == STATUS_OVER) {
@@ -15,29 +28,12 @@ double game_value_for_red(Game *game) {
         }
     }
 
-    double weights[] = {
-        [PIECE_NULL] = 0, [PIECE_EMPTY] = 0, [PIECE_CROWN] = 7,
-        [PIECE_PIKE] = 1, [PIECE_HORSE] = 5, [PIECE_BOW] = 3,
-    };
-
+    const i32 *weights = piece_material;
     double max_score = weights[PIECE_CROWN] + 2 * weights[PIECE_HORSE] + 3 * weights[PIECE_BOW] +
                        5 * weights[PIECE_PIKE];
-    double score = 0.0;
-
-    for (u32 i = 0; i < 81; i++) {
-        u8 piece = game->board[i];
-        if (piece == PIECE_NULL || piece == PIECE_EMPTY) {
-            continue;
-        }
-        double weight = weights[piece & PIECE_KIND_MASK];
-        if ((piece & PLAYER_MASK) == PLAYER_RED) {
-            score += weight;
-        } else {
-            score -= weight;
-        }
-    }
 
-    double result = score / max_score;
+    // `game->material` is kept up to date as pieces are taken and put back by undo.
+    double result = game->material / max_score;
     assert(result > -1.0 && result < 1.0);
     return result;
 }
@@ -50,305 +46,2912 @@ typedef struct {
 
 typedef struct {
     u32 best_command_i;
-    CommandValue command_values[512];
+    u32 root_children_done; // Root children with a value, less than all of them if aborted.
+    CommandValue command_values[COMMANDS_MAX];
 } ExpectiMaxResult;
 
+// Probability a volley hits, 2d6 < 7.
+#define VOLLEY_HIT_PROB 0.4167
+
+// `game_value_for_red` never leaves these, which is what lets chance nodes prune.
+#define VALUE_MIN -1.0
+#define VALUE_MAX 1.0
+
+// Transposition table.
+// Orders inside a turn commute, moving pike A then pike B reaches the same position as B then A,
+// so the search keeps running into positions it already has a value for. Entries are keyed by
+// `game->hash` and replaced unless the slot holds a deeper result for the same position.
+
+typedef enum : u8 {
+    TT_BOUND_NONE = 0,
+    TT_BOUND_EXACT,
+    TT_BOUND_LOWER, // Search failed high, the value is at least this.
+    TT_BOUND_UPPER, // Search failed low, the value is at most this.
+} TTBound;
+
+typedef struct {
+    float value;
+    u8 depth;
+    TTBound bound;
+    u16 best_command; // Packed with `command_pack`, used to search that command first.
+} TTEntry;
+
+// Search threads share the table without locks. A slot is two words written separately, the
+// entry packed into `data` and `check = hash ^ data`. If another thread's write tears the pair
+// the check no longer matches and the probe treats the slot as a miss.
+typedef struct {
+    _Atomic u64 check;
+    _Atomic u64 data;
+} TTSlot;
+
+typedef struct {
+    TTSlot *slots;
+    u64 mask;
+} TranspositionTable;
+
+#define TT_DEFAULT_SIZE_MB 16
+
+static void tt_resize(TranspositionTable *tt, u32 size_mb) {
+    if (size_mb == 0) {
+        size_mb = TT_DEFAULT_SIZE_MB;
+    }
+    // Round down to a power of two so the hash can be masked.
+    u64 count = 1;
+    while (count * 2 * sizeof(TTSlot) <= (u64)size_mb << 20) {
+        count *= 2;
+    }
+    if (tt->slots != NULL && tt->mask + 1 == count) {
+        return;
+    }
+    free(tt->slots);
+    tt->slots = calloc(count, sizeof(TTSlot));
+    assert(tt->slots != NULL);
+    tt->mask = count - 1;
+}
+
+static u64 tt_entry_pack(TTEntry entry) {
+    u32 value_bits;
+    memcpy(&value_bits, &entry.value, sizeof(value_bits));
+    return (u64)value_bits | (u64)entry.depth << 32 | (u64)entry.bound << 40 |
+           (u64)entry.best_command << 48;
+}
+
+static TTEntry tt_entry_unpack(u64 data) {
+    TTEntry entry;
+    u32 value_bits = (u32)data;
+    memcpy(&entry.value, &value_bits, sizeof(entry.value));
+    entry.depth = (u8)(data >> 32);
+    entry.bound = (TTBound)(u8)(data >> 40);
+    entry.best_command = (u16)(data >> 48);
+    return entry;
+}
+
+static bool tt_probe(TranspositionTable *tt, u64 hash, TTEntry *entry) {
+    TTSlot *slot = &tt->slots[hash & tt->mask];
+    u64 check = atomic_load_explicit(&slot->check, memory_order_relaxed);
+    u64 data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+    if ((check ^ data) != hash) {
+        return false;
+    }
+    *entry = tt_entry_unpack(data);
+    return entry->bound != TT_BOUND_NONE;
+}
+
+static void tt_store(TranspositionTable *tt, u64 hash, int depth, TTBound bound, double value,
+                     u16 best_command) {
+    TTEntry old;
+    if (tt_probe(tt, hash, &old) && old.depth > depth) {
+        return;
+    }
+    u64 data = tt_entry_pack((TTEntry){
+        .value = (float)value,
+        .depth = (u8)depth,
+        .bound = bound,
+        .best_command = best_command,
+    });
+    TTSlot *slot = &tt->slots[hash & tt->mask];
+    atomic_store_explicit(&slot->check, hash ^ data, memory_order_relaxed);
+    atomic_store_explicit(&slot->data, data, memory_order_relaxed);
+}
+
+static u16 cpos_pack(CPos cpos) {
+    return (u16)((cpos.r + 4) * 9 + (cpos.q + 4));
+}
+
+// Commands fit in 16 bits, 2 for the kind and 7 for each board index.
+static u16 command_pack(Command command) {
+    return (u16)((u16)command.kind << 14 | cpos_pack(command.piece_pos) << 7 |
+                 cpos_pack(command.target_pos));
+}
+
+#define AI_MAX_THREADS 64
+
+// Monte Carlo search tree, see `ai_select_command_mcts`.
+typedef enum : u8 {
+    MCTS_NODE_DECISION = 0,
+    MCTS_NODE_CHANCE, // A volley before its dice, the children are the hit and the miss.
+} MCTSNodeKind;
+
+typedef struct {
+    u64 hash; // Of the position at this node, set on the first visit.
+    u32 parent;
+    u32 first_child;
+    u32 next_sibling;
+    u32 visits;
+    float value; // Sum of the playout values, for red.
+    u16 command; // From the parent, packed. Outcome nodes repeat the volley.
+    MCTSNodeKind kind;
+    u8 outcome; // VolleyResult applied with `command`.
+    bool expanded;
+} MCTSNode;
+
+
+typedef struct {
+    MCTSNode *nodes; // Pool of MCTS_POOL_NODES, allocated on first use.
+    u32 used;        // Nodes handed out of the pool so far, the free list comes first.
+    u32 free_list;
+    u32 root;
+    Game game; // Position at the root.
+} MCTSTree;
+
+typedef struct AIThreads AIThreads;
+static void ai_threads_free(AIThreads *threads);
+
+typedef struct YBPool YBPool;
+static void yb_pool_free(YBPool *pool);
+
+typedef struct TurnSearch TurnSearch;
+static void turn_search_free(TurnSearch *ts);
+
+typedef struct {
+    u32 time_budget_ms;
+    u32 max_depth;
+    u32 threads;
+    u32 playouts; // MCTS only, 0 searches for the time budget instead.
+    u64 max_nodes;
+} AILimits;
+
+// The rest of the AI's turn as its last search saw it, see `ai_plan_build`. Each step is a
+// position the turn can reach, both outcomes of every volley, with the command to play there.
+#define AI_PLAN_STEPS_MAX 32
+
+typedef struct {
+    u64 hash;
+    Command command; // COMMAND_NONE if the search left no command for it, re-searched shortly.
+    double score;    // For red.
+} AIPlanStep;
+
+typedef struct {
+    AIPlanStep steps[AI_PLAN_STEPS_MAX];
+    u32 count;
+    // Of the search the plan came from, a call with anything else searches again.
+    AIDifficulty difficulty;
+    bool plan_turns;
+    AILimits limits;
+    u32 depth_completed;
+} AIPlan;
+
+// State kept in `AITurn.ai_state` between calls.
+typedef struct {
+    TranspositionTable tt; // Shared by every search thread.
+    // Back the search stacks of each thread, [0] is the calling thread's. Reset at the start of
+    // every search.
+    Arena arenas[AI_MAX_THREADS];
+    // History tables of each thread's move ordering, see `Search.history`. Kept between searches
+    // and halved at the start of each so old cutoffs fade.
+    u32 (*histories[AI_MAX_THREADS])[CELL_COUNT][CELL_COUNT];
+    AIThreads *threads; // Threads 1.. of the parallel searches, started the first time one runs.
+    YBPool *ybwc;       // Workers of the YBWC search, allocated the first time it runs.
+    TurnSearch *turns; // Whole turn search, allocated the first time it runs.
+    MCTSTree mcts;
+    AIPlan plan;
+} AIState;
+
+void ai_state_free(void *ai_state) {
+    AIState *state = ai_state;
+    if (state == NULL) {
+        return;
+    }
+    ai_threads_free(state->threads);
+    free(state->tt.slots);
+    for (u32 i = 0; i < AI_MAX_THREADS; i++) {
+        arena_free(&state->arenas[i]);
+        free(state->histories[i]);
+    }
+    yb_pool_free(state->ybwc);
+    turn_search_free(state->turns);
+    free(state->mcts.nodes);
+    free(state);
+}
+
+// Where a decision node is with its null move, see `expecti_max_node`.
+typedef enum : u8 {
+    NULL_MOVE_NONE = 0,
+    NULL_MOVE_SEARCH, // The END_TURN is applied and its reply is being searched.
+    NULL_MOVE_VERIFY, // It failed high, the node itself is being searched shallower.
+    NULL_MOVE_DONE,   // No cutoff, the node searches its children.
+} NullMovePhase;
+
 typedef struct {
     CommandBuf children;
     size_t children_processed;
     UndoCommand undo_child;
+    bool child_applied;  // undo_child has to be undone before the next child.
+    bool awaiting_child; // A child was pushed, its value is on top of the values stack.
     int depth;
     Command chance_command;
-    double alpha; // Best already found for RED (max player)
-    double beta;  // Best already found for BLUE (min player)
+    double alpha;      // Best already found for RED (max player)
+    double beta;       // Best already found for BLUE (min player)
+    double alpha_orig; // Window the node was entered with, decides the bound stored in the TT.
+    double beta_orig;
+    double best_value;
+    size_t best_child;
+    bool probe; // Star2 probe, only the first child is searched. Its value is a bound.
+    NullMovePhase null_move;
+    bool no_null;       // Null move replies and verifications, two nulls in a row prove nothing.
+    bool child_reduced; // The child being searched is a late quiet move searched shallower.
+    // Chance nodes only, what's known of the hit [0] and miss [1] values.
+    bool probing;      // Still probing the outcomes, the full searches come after.
+    bool outcome_max;  // RED moves after the volley, probes give lower bounds.
+    double outcome_lo[2];
+    double outcome_hi[2];
 } EMNode;
 
-void push_em_node(EMNode **buf, uintptr_t *count, uintptr_t *cap, EMNode n) {
-    if (*count >= *cap) {
-        if (*cap == 0) {
-            *cap = 2;
-        } else {
-            *cap *= 2;
+// A path through the tree is the root plus a decision and a chance node per ply, the values
+// stack never holds more than one value per node on the path.
+#define SEARCH_STACK_MAX (2 * AI_MAX_DEPTH + 2)
+// Every decision node on the path keeps its commands on the move stack, plus the root's commands
+// in generation order.
+#define SEARCH_MOVES_MAX ((AI_MAX_DEPTH + 1) * COMMANDS_MAX)
+
+// Null move pruning. END_TURN is always legal, so passing the rest of the turn is the null move.
+// It's searched NULL_MOVE_R plies shallower, and only NULL_MOVE_MIN_DEPTH or more from the leaves.
+#define NULL_MOVE_R 2
+#define NULL_MOVE_MIN_DEPTH 3
+// Late move reductions. Quiet moves after the first LMR_FULL_CHILDREN get one ply less, unless
+// they beat the window.
+#define LMR_MIN_DEPTH 3
+#define LMR_FULL_CHILDREN 4
+// Width of the windows that only ask which side of a bound a value is on.
+#define NULL_WINDOW 1e-6
+
+static EMNode em_node(int depth, Command chance_command, double alpha, double beta) {
+    return (EMNode){
+        .children = (CommandBuf){0},
+        .children_processed = 0,
+        .undo_child = (UndoCommand){.prev_turn = {0}},
+        .child_applied = false,
+        .awaiting_child = false,
+        .depth = depth,
+        .chance_command = chance_command,
+        .alpha = alpha,
+        .beta = beta,
+        .alpha_orig = alpha,
+        .beta_orig = beta,
+        .best_value = 0.0,
+        .best_child = 0,
+        .probe = false,
+        .null_move = NULL_MOVE_NONE,
+        .no_null = false,
+        .child_reduced = false,
+        .probing = false,
+        .outcome_max = false,
+        .outcome_lo = {VALUE_MIN, VALUE_MIN},
+        .outcome_hi = {VALUE_MAX, VALUE_MAX},
+    };
+}
+
+// Per search settings and counters shared by every node, one per search thread.
+// The stacks are allocated once from the thread's arena, nodes don't touch the heap.
+typedef struct {
+    TranspositionTable *tt;
+    EMNode *stack;        // SEARCH_STACK_MAX nodes.
+    CommandValue *values; // SEARCH_STACK_MAX values.
+    Command *moves;       // SEARCH_MOVES_MAX commands, each node's children are a slice of it.
+    size_t moves_count;
+    Command root_first;  // Searched first at the root, the previous iteration's best command.
+    double deadline_ms;  // Abort when `time_now_ms` passes this, 0 for no deadline.
+    atomic_bool *stop;   // Abort when set, helper threads only.
+    atomic_bool *cancel; // Abort when set, `AITurn.stop`.
+    u64 max_nodes;       // Abort once `nodes` reaches this, 0 for no limit.
+    bool aborted;
+    u64 nodes;
+    AIStats stats;
+    // Move ordering. Quiet commands that caused a cutoff, the last two per remaining depth, and
+    // how often each piece cell to target cell command did for each player. Indexed by the
+    // remaining depth rather than the ply so they mean the same under a YBWC worker's subtrees.
+    Command killers[AI_MAX_DEPTH + 1][2];
+    u32 (*history)[CELL_COUNT][CELL_COUNT]; // [2], one per PLAYER_INDEX.
+    i32 *order_scores;                      // COMMANDS_MAX, scratch for sorting.
+} Search;
+
+static void search_init(Search *search, TranspositionTable *tt, Arena *arena,
+                        u32 (*history)[CELL_COUNT][CELL_COUNT]) {
+    *search = (Search){
+        .tt = tt,
+        .stack = ARENA_ALLOC_ARRAY(arena, EMNode, SEARCH_STACK_MAX),
+        .values = ARENA_ALLOC_ARRAY(arena, CommandValue, SEARCH_STACK_MAX),
+        .moves = ARENA_ALLOC_ARRAY(arena, Command, SEARCH_MOVES_MAX),
+        .moves_count = 0,
+        .root_first = (Command){0},
+        .deadline_ms = 0,
+        .stop = NULL,
+        .cancel = NULL,
+        .max_nodes = 0,
+        .aborted = false,
+        .nodes = 0,
+        .stats = {0},
+        .killers = {{{0}}},
+        .history = history,
+        .order_scores = ARENA_ALLOC_ARRAY(arena, i32, COMMANDS_MAX),
+    };
+    assert(search->stack != NULL && search->values != NULL && search->moves != NULL);
+    assert(search->history != NULL && search->order_scores != NULL);
+}
+
+// Generate the commands of `game` on top of the move stack. The slice is popped by taking its
+// count back off `moves_count`.
+static CommandBuf search_push_commands(Search *search, Game *game) {
+    assert(search->moves_count + COMMANDS_MAX <= SEARCH_MOVES_MAX);
+    CommandBuf buf = {
+        .commands = &search->moves[search->moves_count],
+        .count = 0,
+        .capacity = COMMANDS_MAX,
+    };
+    game_valid_commands(&buf, game);
+    assert(buf.commands == &search->moves[search->moves_count]);
+    search->moves_count += buf.count;
+    return buf;
+}
+
+static bool search_should_stop(Search *search) {
+    if (search->stop != NULL && atomic_load_explicit(search->stop, memory_order_relaxed)) {
+        return true;
+    }
+    if (search->cancel != NULL && atomic_load_explicit(search->cancel, memory_order_relaxed)) {
+        return true;
+    }
+    if (search->max_nodes > 0 && search->nodes >= search->max_nodes) {
+        return true;
+    }
+    return search->deadline_ms > 0 && time_now_ms() >= search->deadline_ms;
+}
+
+static u32 command_index(CommandBuf *command_buf, Command *command) {
+    for (size_t i = 0; i < command_buf->count; i++) {
+        if (command_eq(&command_buf->commands[i], command)) {
+            return (u32)i;
         }
-        *buf = realloc(*buf, *cap * sizeof(**buf));
     }
-    (*buf)[*count] = n;
-    *count += 1;
+    assert(false);
+    return 0;
 }
 
-void push_value(CommandValue **buf, uintptr_t *count, uintptr_t *cap, CommandValue v) {
-    if (*count >= *cap) {
-        if (*cap == 0) {
-            *cap = 2;
-        } else {
-            *cap *= 2;
+// Move ordering scores, higher is searched first.
+#define ORDER_FIRST 1000000  // The TT's best command, or the previous iteration's at the root.
+#define ORDER_CAPTURE 100000 // Plus the victim's weight, less the attacker's.
+#define ORDER_KILLER 90000   // Quiet commands above this never come from history.
+#define ORDER_END_TURN -1    // Rarely the best, and searched last ties go to doing something.
+
+static bool command_is_capture(Game *game, Command command) {
+    if (command.kind != COMMAND_MOVE && command.kind != COMMAND_VOLLEY) {
+        return false;
+    }
+    u8 target = *game_piece(game, command.target_pos);
+    u8 kind = target & PIECE_KIND_MASK;
+    return kind != PIECE_NULL && kind != PIECE_EMPTY && (target & PLAYER_MASK) != game->turn.player;
+}
+
+static i32 command_order_score(Search *search, Game *game, Command command, int depth) {
+    if (command.kind == COMMAND_END_TURN) {
+        return ORDER_END_TURN;
+    }
+    if (command_is_capture(game, command)) {
+        double victim = piece_material[*game_piece(game, command.target_pos) & PIECE_KIND_MASK];
+        double attacker = piece_material[*game_piece(game, command.piece_pos) & PIECE_KIND_MASK];
+        // A volley only takes the piece with the hit's odds.
+        if (command.kind == COMMAND_VOLLEY) {
+            victim *= VOLLEY_HIT_PROB;
+        }
+        return ORDER_CAPTURE + (i32)(victim * 100.0) - (i32)attacker;
+    }
+    if (command_eq(&command, &search->killers[depth][0])) {
+        return ORDER_KILLER + 1;
+    }
+    if (command_eq(&command, &search->killers[depth][1])) {
+        return ORDER_KILLER;
+    }
+    u32 history = search->history[PLAYER_INDEX(game->turn.player)][cpos_cell(command.piece_pos)]
+                                 [cpos_cell(command.target_pos)];
+    return history < ORDER_KILLER ? (i32)history : ORDER_KILLER - 1;
+}
+
+// Sort `children` by `command_order_score`. `first`, or else the TT's best command, goes in front.
+static void search_order_commands(Search *search, Game *game, int depth, CommandBuf *children,
+                                  Command first, TTEntry *entry) {
+    i32 *scores = search->order_scores;
+    for (size_t i = 0; i < children->count; i++) {
+        Command *command = &children->commands[i];
+        bool is_first = first.kind != COMMAND_NONE
+                            ? command_eq(command, &first)
+                            : entry != NULL && command_pack(*command) == entry->best_command;
+        scores[i] = is_first ? ORDER_FIRST : command_order_score(search, game, *command, depth);
+    }
+    // Insertion sort, most commands are quiet with the same score and don't move.
+    for (size_t i = 1; i < children->count; i++) {
+        i32 score = scores[i];
+        Command command = children->commands[i];
+        size_t j = i;
+        while (j > 0 && scores[j - 1] < score) {
+            scores[j] = scores[j - 1];
+            children->commands[j] = children->commands[j - 1];
+            j--;
         }
-        *buf = realloc(*buf, *cap * sizeof(**buf));
+        scores[j] = score;
+        children->commands[j] = command;
     }
-    (*buf)[*count] = v;
-    *count += 1;
 }
 
-double expecti_max_node(ExpectiMaxResult *result, Game *game, int depth) {
+// A quiet command cut off the rest of its siblings, search it early in similar positions.
+static void search_record_cutoff(Search *search, Game *game, Command command, int depth) {
+    if (command.kind != COMMAND_MOVE || command_is_capture(game, command)) {
+        return;
+    }
+    if (!command_eq(&command, &search->killers[depth][0])) {
+        search->killers[depth][1] = search->killers[depth][0];
+        search->killers[depth][0] = command;
+    }
+    u32 *history = &search->history[PLAYER_INDEX(game->turn.player)][cpos_cell(command.piece_pos)]
+                                   [cpos_cell(command.target_pos)];
+    *history += (u32)(depth * depth);
+}
+
+// Store a node's value with the bound its search window allows.
+static void tt_store_result(TranspositionTable *tt, u64 hash, int depth, double best_value,
+                            double alpha_orig, double beta_orig, Command best_command) {
+    TTBound bound = TT_BOUND_EXACT;
+    if (best_value <= alpha_orig) {
+        bound = TT_BOUND_UPPER;
+    } else if (best_value >= beta_orig) {
+        bound = TT_BOUND_LOWER;
+    }
+    tt_store(tt, hash, depth, bound, best_value, command_pack(best_command));
+}
+
+// Search the tree below `root`, a decision node or a chance node for its volley. If the search
+// runs past its deadline it sets `search->aborted`, returns what it has and leaves `game` somewhere
+// inside the tree, so callers pass a copy. The root of the whole search, `is_root`, skips the TT
+// cutoff, null move and reductions, a subtree YBWC hands over is searched like any other node.
+static CommandValue expecti_max_run(ExpectiMaxResult *result, Search *search, Game *game,
+                                    EMNode root, bool is_root) {
+    assert(root.depth <= AI_MAX_DEPTH);
+    TranspositionTable *tt = search->tt;
+    EMNode *stack = search->stack;
+    uintptr_t stack_count = 0;
+    CommandValue *values = search->values;
+    uintptr_t values_count = 0;
+    search->moves_count = 0;
+
+    // The root's children get reordered, results are reported by index into the
+    // `game_valid_commands` order the caller sees.
+    CommandBuf root_commands = {0};
     if (result != NULL) {
         result->best_command_i = 0;
+        result->root_children_done = 0;
         memset(result->command_values, 0, sizeof(result->command_values));
+        root_commands = search_push_commands(search, game);
     }
 
-    EMNode *stack = NULL;
-    uintptr_t stack_count = 0;
-    uintptr_t stack_cap = 0;
-
-    CommandValue *values = NULL;
-    uintptr_t values_count = 0;
-    uintptr_t values_cap = 0;
-
-    push_em_node(&stack, &stack_count, &stack_cap,
-                 (EMNode){
-                     .children = (CommandBuf){0},
-                     .children_processed = 0,
-                     .undo_child = (UndoCommand){0},
-                     .depth = depth,
-                     .chance_command = (Command){0},
-                     .alpha = -INFINITY, // Initialize alpha for root node
-                     .beta = INFINITY,   // Initialize beta for root node
-                 });
+    stack[stack_count++] = root;
 
     while (stack_count > 0) {
+        assert(stack_count <= SEARCH_STACK_MAX && values_count <= SEARCH_STACK_MAX);
         uintptr_t top_i = stack_count - 1;
+        EMNode *node = &stack[top_i];
+        bool at_root = is_root && top_i == 0;
 
-        if (stack[top_i].children.count == 0) {
-            if (stack[top_i].depth == 0 || game->status == STATUS_OVER) {
-                assert(stack[top_i].children.count == 0);
-
-                if (stack[top_i].chance_command.kind != COMMAND_NONE) {
-                    assert(false);
+        if (node->chance_command.kind == COMMAND_VOLLEY) {
+            // Chance node, Ballard's Star1 and Star2. Values are bounded so each outcome's
+            // bounds bound the average. Outcomes are first probed, searching only the first
+            // child of the node after the dice, which bounds that outcome from one side and can
+            // already fail the chance node high (or low when BLUE moves next). Then each outcome
+            // is searched with the window where it would move the average past alpha or beta,
+            // and the node stops as soon as the bounds on the average do.
+            if (node->awaiting_child) {
+                values_count--;
+                double value = values[values_count].value;
+                game_undo_command(game, node->undo_child);
+                node->awaiting_child = false;
+                size_t i = node->children_processed;
+                if (!node->probing) {
+                    // Fail soft, outside the window it's a bound but then the node stops below.
+                    node->outcome_lo[i] = value;
+                    node->outcome_hi[i] = value;
+                } else if (node->outcome_max) {
+                    node->outcome_lo[i] = value;
+                } else {
+                    node->outcome_hi[i] = value;
+                }
+                node->children_processed++;
+                if (node->probing && node->children_processed == 2) {
+                    node->probing = false;
+                    node->children_processed = 0;
                 }
+            } else {
+                // The first time here, probes of leaves would just be the full search.
+                search->stats.chance_nodes++;
+                node->probing = node->depth > 1;
+            }
 
-                // leaf node, compute value.
-                double value = game_value_for_red(game);
-                push_value(&values, &values_count, &values_cap,
-                           (CommandValue){
-                               .value = value,
-                           });
+            double probs[2] = {VOLLEY_HIT_PROB, 1.0 - VOLLEY_HIT_PROB};
+            double lo = probs[0] * node->outcome_lo[0] + probs[1] * node->outcome_lo[1];
+            double hi = probs[0] * node->outcome_hi[0] + probs[1] * node->outcome_hi[1];
+            bool done = lo >= node->beta || hi <= node->alpha ||
+                        (!node->probing && node->children_processed == 2);
+            if (done) {
+                values[values_count++] = (CommandValue){
+                    .value = lo >= node->beta ? lo : hi,
+                    .hit_value = node->outcome_lo[0],
+                    .miss_value = node->outcome_lo[1],
+                };
                 stack_count--;
-            } else {
-                // First time visiting this node, expand children, next iteration will push first
-                // one.
-                game_valid_commands(&stack[top_i].children, game);
-                assert(stack[top_i].children.count > 0);
-            }
-        } else if (stack[top_i].children_processed < stack[top_i].children.count) {
-            // Check for pruning before processing the next child
-            bool should_prune = false;
-
-            // We can prune if alpha >= beta (cutoff)
-            if (stack[top_i].alpha >= stack[top_i].beta) {
-                // Don't prune chance nodes
-                if (stack[top_i].chance_command.kind != COMMAND_VOLLEY) {
-                    should_prune = true;
-                }
+                continue;
             }
 
-            if (should_prune) {
-                // Skip to processing the results since we're pruning
-                stack[top_i].children_processed = stack[top_i].children.count;
-            } else if (stack[top_i].chance_command.kind == COMMAND_VOLLEY) {
-                assert(stack[top_i].children.count == 2);
-                Command child_command = stack[top_i].chance_command;
-                if (stack[top_i].children_processed == 0) {
-                    stack[top_i].undo_child =
-                        game_apply_command(game, game->turn.player, child_command, VOLLEY_HIT);
-                    push_em_node(&stack, &stack_count, &stack_cap,
-                                 (EMNode){
-                                     .children = (CommandBuf){0},
-                                     .children_processed = 0,
-                                     .undo_child = (UndoCommand){0},
-                                     .depth = stack[top_i].depth - 1,
-                                     .chance_command = (Command){0},
-                                     .alpha = stack[top_i].alpha,
-                                     .beta = stack[top_i].beta,
-                                 });
-                    stack[top_i].children_processed++;
-                } else {
-                    game_undo_command(game, stack[top_i].undo_child);
-                    stack[top_i].undo_child =
-                        game_apply_command(game, game->turn.player, child_command, VOLLEY_MISS);
-                    push_em_node(&stack, &stack_count, &stack_cap,
-                                 (EMNode){
-                                     .children = (CommandBuf){0},
-                                     .children_processed = 0,
-                                     .undo_child = (UndoCommand){0},
-                                     .depth = stack[top_i].depth - 1,
-                                     .chance_command = (Command){0},
-                                     .alpha = stack[top_i].alpha,
-                                     .beta = stack[top_i].beta,
-                                 });
-                    stack[top_i].children_processed++;
-                }
-            } else {
-                if (stack[top_i].children_processed > 0) {
-                    game_undo_command(game, stack[top_i].undo_child);
-                }
-                Command child_command =
-                    stack[top_i].children.commands[stack[top_i].children_processed];
-                if (child_command.kind == COMMAND_VOLLEY) {
-                    // Don't apply the command, push a chance node instead.
-                    push_em_node(&stack, &stack_count, &stack_cap,
-                                 (EMNode){
-                                     .children = (CommandBuf){.count = 2},
-                                     .children_processed = 0,
-                                     .undo_child = (UndoCommand){.prev_turn = game->turn},
-                                     .depth = stack[top_i].depth,
-                                     .chance_command = child_command,
-                                     .alpha = stack[top_i].alpha,
-                                     .beta = stack[top_i].beta,
-                                 });
-                    stack[top_i].children_processed++;
+            size_t i = node->children_processed;
+            VolleyResult outcome = i == 0 ? VOLLEY_HIT : VOLLEY_MISS;
+            node->undo_child =
+                game_apply_command(game, game->turn.player, node->chance_command, outcome);
+            node->awaiting_child = true;
+            node->outcome_max = game->turn.player == PLAYER_RED;
+            // The outcome's values where the average crosses alpha and beta.
+            double alpha = (node->alpha - (hi - probs[i] * node->outcome_hi[i])) / probs[i];
+            double beta = (node->beta - (lo - probs[i] * node->outcome_lo[i])) / probs[i];
+            if (node->probing) {
+                // A probe only bounds one side, the other end of its window is the bound it
+                // improves on so whatever comes back is a bound in that direction.
+                if (node->outcome_max) {
+                    alpha = node->outcome_lo[i];
                 } else {
-                    stack[top_i].undo_child =
-                        game_apply_command(game, game->turn.player, child_command, VOLLEY_ROLL);
-                    push_em_node(&stack, &stack_count, &stack_cap,
-                                 (EMNode){
-                                     .children = (CommandBuf){0},
-                                     .children_processed = 0,
-                                     .undo_child = (UndoCommand){0},
-                                     .depth = stack[top_i].depth - 1,
-                                     .chance_command = (Command){0},
-                                     .alpha = stack[top_i].alpha,
-                                     .beta = stack[top_i].beta,
-                                 });
-                    stack[top_i].children_processed++;
+                    beta = node->outcome_hi[i];
                 }
             }
-        } else if (stack[top_i].children_processed == stack[top_i].children.count) {
-            // Compute own value.
-            if (stack[top_i].chance_command.kind == COMMAND_VOLLEY) {
-                assert(stack[top_i].children.commands == NULL);
-                assert(stack[top_i].children.count == 2);
-                game_undo_command(game, stack[top_i].undo_child);
-                values_count -= 2;
-                double hit_value = values[values_count].value;
-                double miss_value = values[values_count + 1].value;
-                double value = 0.4167 * hit_value + (1.0 - 0.4167) * miss_value;
-                push_value(&values, &values_count, &values_cap,
-                           (CommandValue){
-                               .value = value,
-                               .hit_value = hit_value,
-                               .miss_value = miss_value,
-                           });
-                stack_count--;
-            } else {
-                if (stack[top_i].children.count > 0) {
-                    game_undo_command(game, stack[top_i].undo_child);
+            stack[stack_count++] = em_node(node->depth - 1, (Command){0}, alpha, beta);
+            stack[stack_count - 1].probe = node->probing;
+            continue;
+        }
+
+        if (node->children.count == 0) {
+            bool min_node = game->turn.player == PLAYER_BLUE;
+            TTEntry tt_entry;
+            TTEntry *entry = NULL;
+            if (node->null_move == NULL_MOVE_NONE) {
+                search->nodes++;
+                if ((search->nodes & 1023) == 0 && search_should_stop(search)) {
+                    search->aborted = true;
+                    break;
                 }
-                bool min_node = game->turn.player == PLAYER_BLUE;
-                double best_value = min_node ? INFINITY : -INFINITY;
 
-                // If we pruned, we might not have values for all children
-                size_t values_to_pop = stack[top_i].children_processed;
-                if (values_to_pop > stack[top_i].children.count) {
-                    values_to_pop = stack[top_i].children.count;
+                if (node->depth == 0 || game->status == STATUS_OVER) {
+                    // leaf node, compute value.
+                    search->stats.leaf_evals++;
+                    double value = game_value_for_red(game);
+                    values[values_count++] = (CommandValue){.value = value};
+                    stack_count--;
+                    continue;
                 }
 
-                // If no children were processed (due to pruning at the start), use the
-                // the bound value that caused pruning
-                if (values_to_pop == 0) {
-                    if (min_node) {
-                        best_value = stack[top_i].beta;
-                    } else {
-                        best_value = stack[top_i].alpha;
+                // First time visiting this node, check the TT before expanding children.
+                entry = tt != NULL && tt_probe(tt, game->hash, &tt_entry) ? &tt_entry : NULL;
+                search->stats.tt_probes += tt != NULL;
+                search->stats.tt_hits += entry != NULL;
+                if (entry != NULL && !at_root && entry->depth >= node->depth) {
+                    double value = entry->value;
+                    if (entry->bound == TT_BOUND_EXACT ||
+                        (entry->bound == TT_BOUND_LOWER && value >= node->beta) ||
+                        (entry->bound == TT_BOUND_UPPER && value <= node->alpha)) {
+                        values[values_count++] = (CommandValue){.value = value};
+                        stack_count--;
+                        continue;
                     }
-                } else {
-                    values_count -= values_to_pop;
-                    for (size_t i = 0; i < values_to_pop; i++) {
-                        CommandValue command_value = values[values_count + i];
-
-                        if (min_node) {
-                            if (command_value.value <= best_value) {
-                                best_value = command_value.value;
-                                if (result != NULL && stack[top_i].depth == depth) {
-                                    result->best_command_i = (u32)i;
-                                    result->command_values[i] = command_value;
-                                }
-                            }
-                            // Update beta (for min node)
-                            if (best_value < stack[top_i].beta) {
-                                stack[top_i].beta = best_value;
-                            }
-                        } else {
-                            if (command_value.value >= best_value) {
-                                best_value = command_value.value;
-                                if (result != NULL && stack[top_i].depth == depth) {
-                                    result->best_command_i = (u32)i;
-                                    result->command_values[i] = command_value;
-                                }
-                            }
-                            // Update alpha (for max node)
-                            if (best_value > stack[top_i].alpha) {
-                                stack[top_i].alpha = best_value;
-                            }
-                        }
+                }
+
+                // Null move. If ending the turn now still fails high at a reduced depth, so
+                // would searching the commands. Only tried when the static value is already
+                // past the bound, otherwise it rarely cuts.
+                node->null_move = NULL_MOVE_DONE;
+                double value = game_value_for_red(game);
+                bool null_move = !at_root && !node->no_null &&
+                                 node->depth >= NULL_MOVE_MIN_DEPTH &&
+                                 (min_node ? value <= node->alpha : value >= node->beta);
+                if (null_move) {
+                    Command end_turn = {.kind = COMMAND_END_TURN};
+                    node->undo_child =
+                        game_apply_command(game, game->turn.player, end_turn, VOLLEY_ROLL);
+                    node->null_move = NULL_MOVE_SEARCH;
+                    double alpha = min_node ? node->alpha : node->beta - NULL_WINDOW;
+                    double beta = min_node ? node->alpha + NULL_WINDOW : node->beta;
+                    stack[stack_count++] =
+                        em_node(node->depth - 1 - NULL_MOVE_R, (Command){0}, alpha, beta);
+                    stack[stack_count - 1].no_null = true;
+                    continue;
+                }
+            } else if (node->null_move != NULL_MOVE_DONE) {
+                values_count--;
+                double value = values[values_count].value;
+                if (node->null_move == NULL_MOVE_SEARCH) {
+                    game_undo_command(game, node->undo_child);
+                    min_node = game->turn.player == PLAYER_BLUE;
+                }
+                bool fails = min_node ? value <= node->alpha : value >= node->beta;
+                if (fails && node->null_move == NULL_MOVE_SEARCH) {
+                    // END_TURN is one of the node's own commands so there's no zugzwang, what
+                    // goes wrong is the shallower search missing a threat. Verify with a
+                    // reduced search of the node itself before cutting.
+                    node->null_move = NULL_MOVE_VERIFY;
+                    stack[stack_count++] = em_node(node->depth - NULL_MOVE_R, (Command){0},
+                                                   node->alpha, node->beta);
+                    stack[stack_count - 1].no_null = true;
+                    continue;
+                }
+                if (fails) {
+                    if (tt != NULL && !node->probe) {
+                        tt_store_result(tt, game->hash, node->depth, value, node->alpha_orig,
+                                        node->beta_orig, (Command){0});
                     }
+                    values[values_count++] = (CommandValue){.value = value};
+                    stack_count--;
+                    continue;
                 }
+                node->null_move = NULL_MOVE_DONE;
+                entry = tt != NULL && tt_probe(tt, game->hash, &tt_entry) ? &tt_entry : NULL;
+            }
+
+            node->children = search_push_commands(search, game);
+            assert(node->children.count > 0);
+            search->stats.expanded++;
 
-                push_value(&values, &values_count, &values_cap,
-                           (CommandValue){
-                               .value = best_value,
-                           });
-                if (stack[top_i].children.commands != NULL) {
-                    free(stack[top_i].children.commands);
+            search_order_commands(search, game, node->depth, &node->children,
+                                  at_root ? search->root_first : (Command){0}, entry);
+
+            node->best_value = min_node ? INFINITY : -INFINITY;
+            node->best_child = 0;
+        }
+
+        if (node->awaiting_child) {
+            values_count--;
+            CommandValue child_value = values[values_count];
+            if (node->child_reduced) {
+                // The reduced search beat the window after all, search it again at full depth.
+                // The child is still applied, the node's player is the one before it.
+                node->child_reduced = false;
+                bool min_node = node->undo_child.prev_turn.player == PLAYER_BLUE;
+                if (min_node ? child_value.value < node->beta : child_value.value > node->alpha) {
+                    stack[stack_count++] =
+                        em_node(node->depth - 1, (Command){0}, node->alpha, node->beta);
+                    continue;
                 }
-                stack_count--;
             }
-        } else {
-            assert(0);
+            if (node->child_applied) {
+                game_undo_command(game, node->undo_child);
+                node->child_applied = false;
+            }
+            node->awaiting_child = false;
+
+            bool min_node = game->turn.player == PLAYER_BLUE;
+            size_t child_i = node->children_processed - 1;
+            bool improved = min_node ? child_value.value < node->best_value
+                                     : child_value.value > node->best_value;
+            if (improved) {
+                node->best_value = child_value.value;
+                node->best_child = child_i;
+            }
+
+            // Root results are kept up to date as children finish so an aborted search still
+            // has a best command.
+            if (result != NULL && top_i == 0) {
+                u32 command_i = command_index(&root_commands, &node->children.commands[child_i]);
+                result->command_values[command_i] = child_value;
+                result->root_children_done++;
+                if (improved) {
+                    result->best_command_i = command_i;
+                }
+            }
+
+            if (min_node) {
+                // Update beta (for min node)
+                if (node->best_value < node->beta) {
+                    node->beta = node->best_value;
+                }
+            } else {
+                // Update alpha (for max node)
+                if (node->best_value > node->alpha) {
+                    node->alpha = node->best_value;
+                }
+            }
+            if (node->alpha >= node->beta) {
+                search_record_cutoff(search, game, node->children.commands[child_i], node->depth);
+                search->stats.cutoffs[node->depth]++;
+            }
         }
-    }
 
-    assert(values_count == 1);
-    double score = values[0].value;
+        // Keep going until every child is searched or alpha >= beta cuts off the rest.
+        if (node->children_processed < node->children.count && node->alpha < node->beta &&
+            !(node->probe && node->children_processed > 0)) {
+            Command child_command = node->children.commands[node->children_processed];
+            int child_depth = node->depth;
+            search->stats.children++;
+            double alpha = node->alpha;
+            double beta = node->beta;
+            node->children_processed++;
+            node->awaiting_child = true;
+            if (child_command.kind == COMMAND_VOLLEY) {
+                // Don't apply the command, push a chance node instead.
+                stack[stack_count++] = em_node(child_depth, child_command, alpha, beta);
+            } else {
+                // Late quiet moves are searched a ply shallower with a null window, they're
+                // searched again in full only if they beat it.
+                bool reduce = !at_root && !node->probe && node->depth >= LMR_MIN_DEPTH &&
+                              node->children_processed > LMR_FULL_CHILDREN &&
+                              child_command.kind == COMMAND_MOVE &&
+                              !command_is_capture(game, child_command) &&
+                              !command_eq(&child_command, &search->killers[node->depth][0]) &&
+                              !command_eq(&child_command, &search->killers[node->depth][1]);
+                if (reduce) {
+                    child_depth--;
+                    if (game->turn.player == PLAYER_BLUE) {
+                        alpha = beta - NULL_WINDOW;
+                    } else {
+                        beta = alpha + NULL_WINDOW;
+                    }
+                }
+                node->child_reduced = reduce;
+                node->undo_child =
+                    game_apply_command(game, game->turn.player, child_command, VOLLEY_ROLL);
+                node->child_applied = true;
+                stack[stack_count++] = em_node(child_depth - 1, (Command){0}, alpha, beta);
+            }
+            continue;
+        }
 
-    free(stack);
-    free(values);
+        // Compute own value.
+        double best_value = node->best_value;
+        Command best_command = node->children.commands[node->best_child];
+        if (tt != NULL && !node->probe) {
+            tt_store_result(tt, game->hash, node->depth, best_value, node->alpha_orig,
+                            node->beta_orig, best_command);
+        }
 
-    return score;
-}
+        values[values_count++] = (CommandValue){.value = best_value};
+        search->moves_count -= node->children.count;
+        stack_count--;
+    }
 
-u32 ai_select_command_easy(Game *game) {
-    ExpectiMaxResult result = {0};
-    expecti_max_node(&result, game, 3);
-    return result.best_command_i;
+    if (search->aborted) {
+        if (result != NULL && result->root_children_done > 0) {
+            return result->command_values[result->best_command_i];
+        }
+        return (CommandValue){0};
+    }
+    assert(values_count == 1);
+    return values[0];
 }
 
-u32 ai_select_command_medium(Game *game) {
-    ExpectiMaxResult result = {0};
-    expecti_max_node(&result, game, 4);
-    return result.best_command_i;
+// Search `depth` plies below `game` with the window `alpha`, `beta`, see `expecti_max_run`.
+double expecti_max_node(ExpectiMaxResult *result, Search *search, Game *game, int depth,
+                        double alpha, double beta) {
+    return expecti_max_run(result, search, game, em_node(depth, (Command){0}, alpha, beta), true)
+        .value;
 }
 
-u32 ai_select_command_hard(Game *game) {
-    ExpectiMaxResult result = {0};
-    expecti_max_node(&result, game, 5);
-    return result.best_command_i;
+static AIState *ai_state_get(AITurn *ai_turn, u32 threads) {
+    if (ai_turn->ai_state == NULL) {
+        ai_turn->ai_state = calloc(1, sizeof(AIState));
+        assert(ai_turn->ai_state != NULL);
+    }
+    AIState *state = ai_turn->ai_state;
+    for (u32 i = 0; i < threads; i++) {
+        if (state->arenas[i].base == NULL) {
+            // The root's commands plus what `search_init` takes, with room for alignment.
+            arena_init(&state->arenas[i], sizeof(Command) * (COMMANDS_MAX + SEARCH_MOVES_MAX) +
+                                              sizeof(EMNode) * SEARCH_STACK_MAX +
+                                              sizeof(CommandValue) * SEARCH_STACK_MAX +
+                                              sizeof(i32) * COMMANDS_MAX + 5 * 16);
+        }
+        state->arenas[i].used = 0;
+        if (state->histories[i] == NULL) {
+            state->histories[i] = calloc(2, sizeof(*state->histories[i]));
+            assert(state->histories[i] != NULL);
+        }
+        u32 *history = &state->histories[i][0][0][0];
+        for (size_t j = 0; j < 2 * CELL_COUNT * CELL_COUNT; j++) {
+            history[j] >>= 1;
+        }
+    }
+    tt_resize(&state->tt, ai_turn->tt_size_mb);
+    return state;
 }
 
-int ai_select_command(void *ptr) {
-    AITurn *ai_turn = (AITurn *)ptr;
-    Game *game = &ai_turn->game;
-    switch (ai_turn->difficulty) {
+// Defaults for each difficulty, used for any limit the caller leaves at 0.
+// The web build has a pool of 4 threads and the AI runs on one of them, hard fills the rest.
+static AILimits ai_difficulty_limits(AIDifficulty difficulty) {
+    switch (difficulty) {
     case AIDIFF_EASY:
-        ai_turn->selected_command_i = ai_select_command_easy(game);
-        break;
+        return (AILimits){.time_budget_ms = 250, .max_depth = 3, .threads = 1};
     case AIDIFF_MEDIUM:
-        ai_turn->selected_command_i = ai_select_command_medium(game);
-        break;
+        return (AILimits){.time_budget_ms = 1000, .max_depth = 5, .threads = 2};
     case AIDIFF_HARD:
-        ai_turn->selected_command_i = ai_select_command_hard(game);
-        break;
+        return (AILimits){.time_budget_ms = 3000, .max_depth = AI_MAX_DEPTH, .threads = 4};
+    case AIDIFF_MCTS:
+        return (AILimits){.time_budget_ms = 1000, .threads = 1};
     default:
         assert(false);
-        return -1;
+        return (AILimits){0};
     }
-    return 0;
+}
+
+// The threads besides the caller's that a parallel search runs on. They're started the first
+// time a search asks for them and wait on `wake` between searches. Each search hands every
+// thread it uses a job, returns once `ai_threads_wait` sees them all finished, and leaves the
+// threads parked for the next one.
+typedef struct {
+    void (*run)(void *arg); // NULL if the thread sits this search out.
+    void *arg;
+} AIJob;
+
+typedef struct {
+    AIThreads *threads;
+    u32 thread_i;
+    u32 generation; // Of the last search the thread looked at.
+    pthread_t thread;
+    bool started;
+} AIThread;
+
+struct AIThreads {
+    pthread_mutex_t mutex;
+    pthread_cond_t wake; // A search handed out jobs, or the threads exit.
+    pthread_cond_t idle; // The last job of a search finished.
+    u32 generation;      // Counts the searches that handed out jobs.
+    u32 busy;            // Jobs of the current search still running.
+    bool exit;
+    AIJob jobs[AI_MAX_THREADS]; // [0] is the caller's and never used.
+    AIThread threads[AI_MAX_THREADS];
+};
+
+static void *ai_thread_main(void *ptr) {
+    AIThread *thread = ptr;
+    AIThreads *threads = thread->threads;
+    pthread_mutex_lock(&threads->mutex);
+    for (;;) {
+        while (!threads->exit && thread->generation == threads->generation) {
+            pthread_cond_wait(&threads->wake, &threads->mutex);
+        }
+        if (threads->exit) {
+            break;
+        }
+        thread->generation = threads->generation;
+        AIJob job = threads->jobs[thread->thread_i];
+        if (job.run == NULL) {
+            continue;
+        }
+        pthread_mutex_unlock(&threads->mutex);
+        job.run(job.arg);
+        pthread_mutex_lock(&threads->mutex);
+        threads->busy--;
+        if (threads->busy == 0) {
+            pthread_cond_signal(&threads->idle);
+        }
+    }
+    pthread_mutex_unlock(&threads->mutex);
+    return NULL;
+}
+
+static AIThreads *ai_threads_get(AIState *state) {
+    if (state->threads == NULL) {
+        AIThreads *threads = calloc(1, sizeof(AIThreads));
+        assert(threads != NULL);
+        pthread_mutex_init(&threads->mutex, NULL);
+        pthread_cond_init(&threads->wake, NULL);
+        pthread_cond_init(&threads->idle, NULL);
+        state->threads = threads;
+    }
+    return state->threads;
+}
+
+// Run `jobs` 1 to `count` - 1 on their threads, starting any that aren't yet. Searching with
+// fewer threads than asked for is fine if the platform runs out, those jobs don't run.
+static void ai_threads_run(AIThreads *threads, u32 count) {
+    for (u32 i = 1; i < count; i++) {
+        AIThread *thread = &threads->threads[i];
+        if (!thread->started) {
+            // Still on the last generation, so it picks up this one's job.
+            *thread = (AIThread){
+                .threads = threads,
+                .thread_i = i,
+                .generation = threads->generation,
+            };
+            thread->started = pthread_create(&thread->thread, NULL, ai_thread_main, thread) == 0;
+        }
+    }
+    pthread_mutex_lock(&threads->mutex);
+    assert(threads->busy == 0);
+    for (u32 i = 1; i < AI_MAX_THREADS; i++) {
+        if (i >= count) {
+            threads->jobs[i] = (AIJob){0};
+        }
+        threads->busy += threads->threads[i].started && threads->jobs[i].run != NULL;
+    }
+    threads->generation++;
+    pthread_cond_broadcast(&threads->wake);
+    pthread_mutex_unlock(&threads->mutex);
+}
+
+// Wait for the jobs of `ai_threads_run` to return, the caller tells them to first.
+static void ai_threads_wait(AIThreads *threads) {
+    pthread_mutex_lock(&threads->mutex);
+    while (threads->busy > 0) {
+        pthread_cond_wait(&threads->idle, &threads->mutex);
+    }
+    pthread_mutex_unlock(&threads->mutex);
+}
+
+static void ai_threads_free(AIThreads *threads) {
+    if (threads == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&threads->mutex);
+    threads->exit = true;
+    pthread_cond_broadcast(&threads->wake);
+    pthread_mutex_unlock(&threads->mutex);
+    for (u32 i = 1; i < AI_MAX_THREADS; i++) {
+        if (threads->threads[i].started) {
+            pthread_join(threads->threads[i].thread, NULL);
+        }
+    }
+    pthread_cond_destroy(&threads->idle);
+    pthread_cond_destroy(&threads->wake);
+    pthread_mutex_destroy(&threads->mutex);
+    free(threads);
+}
+
+// Lazy SMP. Helper threads run their own iterative deepening over the same root and share
+// nothing but the transposition table. The values they store cut off and order the main
+// thread's search, their own results are thrown away. Odd helpers run a ply ahead so the
+// threads don't all search the same tree in lockstep.
+typedef struct {
+    TranspositionTable *tt;
+    Arena *arena;
+    u32 (*history)[CELL_COUNT][CELL_COUNT];
+    Game game;
+    u32 thread_i;
+    u32 max_depth;
+    atomic_bool *stop;
+    u64 nodes; // Searched, set when the job returns with the stats.
+    AIStats stats;
+} AIHelper;
+
+static void ai_helper_main(void *ptr) {
+    AIHelper *helper = ptr;
+    Search search;
+    search_init(&search, helper->tt, helper->arena, helper->history);
+    search.stop = helper->stop;
+    for (u32 depth = 1 + (helper->thread_i & 1); depth <= helper->max_depth; depth++) {
+        Game search_game = helper->game;
+        expecti_max_node(NULL, &search, &search_game, (int)depth, -INFINITY, INFINITY);
+        if (search.aborted) {
+            break;
+        }
+    }
+    helper->nodes = search.nodes;
+    helper->stats = search.stats;
+}
+
+// Young Brothers Wait. The eldest child of a node is searched alone to narrow the window, then
+// its younger brothers are pushed as tasks on the worker's deque where idle workers steal them.
+// Both outcomes of a volley are tasks as well. A worker waiting on its tasks takes them back or
+// steals others' instead of sitting idle. Below YBWC_MIN_SPLIT_DEPTH a split costs more than it
+// gains and the subtree is searched by `expecti_max_run` on the worker's own stacks. Split nodes
+// prune like the serial ones, the null move, reductions of late quiet brothers, killers and
+// history, and Star1 and Star2 at chance nodes, so both search the same tree.
+
+#define YBWC_MIN_SPLIT_DEPTH 3
+#define YBWC_DEQUE_SIZE 4096
+#define YBWC_FRAMES_SIZE (8 << 20)
+// Steals a waiting worker stacks on top of each other before it only waits on its own tasks.
+#define YBWC_MAX_NESTING 8
+
+typedef struct YBSplit YBSplit;
+
+typedef struct {
+    YBSplit *split;
+    size_t child_i; // Index into the split's children, for chance splits 0 hit and 1 miss.
+} YBTask;
+
+struct YBSplit {
+    atomic_flag lock; // Guards the window and best value while tasks are out.
+    Game game;        // Read only once the tasks are pushed, each task searches from a copy.
+    int depth;
+    bool min_node;
+    Command chance_command; // The volley for chance splits, the children are its outcomes.
+    bool probing;           // Chance splits, the outcomes are Star2 probes.
+    double outcome_alpha[2];
+    double outcome_beta[2];
+    CommandBuf children;
+    double alpha;
+    double beta;
+    double alpha_orig;
+    double beta_orig;
+    double best_value;
+    size_t best_child;
+    double outcome_values[2];
+    atomic_bool cutoff;
+    atomic_uint pending; // Tasks not finished yet.
+    // Root only, reported like `expecti_max_node` does.
+    ExpectiMaxResult *result;
+    CommandBuf *root_commands;
+    Command root_first;
+};
+
+// Chase-Lev deque, the owner pushes and takes at the bottom and thieves steal from the top.
+typedef struct {
+    _Atomic i64 top;
+    _Atomic i64 bottom;
+    YBTask *_Atomic tasks[YBWC_DEQUE_SIZE];
+} YBDeque;
+
+typedef struct {
+    YBDeque deque;
+    YBPool *pool;
+    Search *search;    // Stacks for the serial subtrees, the main search's on worker 0.
+    Search own_search; // Backs `search` on the other workers.
+    Arena frames;      // Splits, commands and tasks of the nodes this worker is waiting in.
+    u32 nesting;
+    u64 rng;
+} YBWorker;
+
+struct YBPool {
+    YBWorker workers[AI_MAX_THREADS];
+    u32 worker_count;
+    AIThreads *threads; // Run workers 1.. as their jobs.
+    atomic_bool stop;   // A worker ran out of time, everything in flight is thrown away.
+    atomic_bool done;   // The search is over, the workers' jobs return.
+};
+
+static bool yb_deque_push(YBDeque *deque, YBTask *task) {
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= YBWC_DEQUE_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&deque->tasks[bottom & (YBWC_DEQUE_SIZE - 1)], task,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+static YBTask *yb_deque_take(YBDeque *deque) {
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    YBTask *task =
+        atomic_load_explicit(&deque->tasks[bottom & (YBWC_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // Last task, a thief could be taking it at the same time.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static YBTask *yb_deque_steal(YBDeque *deque) {
+    i64 top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    YBTask *task =
+        atomic_load_explicit(&deque->tasks[top & (YBWC_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+// Try every other worker once, starting from a random one.
+static YBTask *yb_steal(YBWorker *worker) {
+    YBPool *pool = worker->pool;
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 7;
+    worker->rng ^= worker->rng << 17;
+    u32 start = (u32)(worker->rng % pool->worker_count);
+    for (u32 i = 0; i < pool->worker_count; i++) {
+        YBWorker *victim = &pool->workers[(start + i) % pool->worker_count];
+        if (victim == worker) {
+            continue;
+        }
+        YBTask *task = yb_deque_steal(&victim->deque);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static bool yb_stopped(YBPool *pool) {
+    return atomic_load_explicit(&pool->stop, memory_order_relaxed);
+}
+
+static void yb_lock(YBSplit *split) {
+    while (atomic_flag_test_and_set_explicit(&split->lock, memory_order_acquire)) {
+    }
+}
+
+static void yb_unlock(YBSplit *split) {
+    atomic_flag_clear_explicit(&split->lock, memory_order_release);
+}
+
+static void yb_split_init(YBSplit *split, Game *game, int depth, double alpha, double beta) {
+    atomic_flag_clear(&split->lock);
+    split->game = *game;
+    split->depth = depth;
+    split->min_node = game->turn.player == PLAYER_BLUE;
+    split->chance_command = (Command){0};
+    split->probing = false;
+    split->children = (CommandBuf){0};
+    split->alpha = alpha;
+    split->beta = beta;
+    split->alpha_orig = alpha;
+    split->beta_orig = beta;
+    split->best_value = split->min_node ? INFINITY : -INFINITY;
+    split->best_child = 0;
+    split->outcome_values[0] = 0.0;
+    split->outcome_values[1] = 0.0;
+    atomic_init(&split->cutoff, false);
+    atomic_init(&split->pending, 0);
+    split->result = NULL;
+    split->root_commands = NULL;
+    split->root_first = (Command){0};
+}
+
+// Fold a finished child into its split, same as a node on the `expecti_max_run` stack does. The
+// killers and history that record a cutoff are `worker`'s, like the serial search's are its own.
+static void yb_record(YBWorker *worker, YBSplit *split, size_t child_i, CommandValue child_value) {
+    yb_lock(split);
+    bool improved = split->min_node ? child_value.value < split->best_value
+                                    : child_value.value > split->best_value;
+    if (improved) {
+        split->best_value = child_value.value;
+        split->best_child = child_i;
+    }
+    if (split->min_node) {
+        if (split->best_value < split->beta) {
+            split->beta = split->best_value;
+        }
+    } else {
+        if (split->best_value > split->alpha) {
+            split->alpha = split->best_value;
+        }
+    }
+    if (split->alpha >= split->beta &&
+        !atomic_load_explicit(&split->cutoff, memory_order_relaxed)) {
+        atomic_store_explicit(&split->cutoff, true, memory_order_relaxed);
+        search_record_cutoff(worker->search, &split->game, split->children.commands[child_i],
+                             split->depth);
+    }
+    if (split->result != NULL) {
+        ExpectiMaxResult *result = split->result;
+        u32 command_i = command_index(split->root_commands, &split->children.commands[child_i]);
+        result->command_values[command_i] = child_value;
+        result->root_children_done++;
+        if (improved) {
+            result->best_command_i = command_i;
+        }
+    }
+    yb_unlock(split);
+}
+
+static CommandValue yb_decision(YBWorker *worker, Game *game, int depth, double alpha,
+                                double beta, YBSplit *root, bool no_null, bool probe);
+static void yb_run_task(YBWorker *worker, YBTask *task);
+
+// Run tasks until every task of `split` is done.
+static void yb_wait(YBWorker *worker, YBSplit *split) {
+    while (atomic_load_explicit(&split->pending, memory_order_acquire) > 0) {
+        YBTask *task = yb_deque_take(&worker->deque);
+        if (task == NULL && worker->nesting < YBWC_MAX_NESTING) {
+            task = yb_steal(worker);
+        }
+        if (task == NULL) {
+            sched_yield();
+            continue;
+        }
+        worker->nesting++;
+        yb_run_task(worker, task);
+        worker->nesting--;
+    }
+}
+
+// Push tasks `first`..`last` of `split` so the worker takes `first` back first.
+static void yb_split_tasks(YBWorker *worker, YBSplit *split, YBTask *tasks, size_t first,
+                           size_t last) {
+    atomic_store_explicit(&split->pending, (u32)(last - first + 1), memory_order_relaxed);
+    for (size_t i = last + 1; i-- > first;) {
+        tasks[i] = (YBTask){.split = split, .child_i = i};
+        if (!yb_deque_push(&worker->deque, &tasks[i])) {
+            yb_run_task(worker, &tasks[i]);
+        }
+    }
+    yb_wait(worker, split);
+}
+
+static void yb_outcome(YBWorker *worker, YBSplit *split, size_t outcome_i) {
+    Game outcome_game = split->game;
+    game_apply_command(&outcome_game, outcome_game.turn.player, split->chance_command,
+                       outcome_i == 0 ? VOLLEY_HIT : VOLLEY_MISS);
+    split->outcome_values[outcome_i] =
+        yb_decision(worker, &outcome_game, split->depth - 1, split->outcome_alpha[outcome_i],
+                    split->outcome_beta[outcome_i], NULL, false, split->probing)
+            .value;
+}
+
+static CommandValue yb_serial(YBWorker *worker, Game *game, EMNode root) {
+    Game search_game = *game;
+    CommandValue value = expecti_max_run(NULL, worker->search, &search_game, root, false);
+    if (worker->search->aborted) {
+        atomic_store(&worker->pool->stop, true);
+    }
+    return value;
+}
+
+// Star1 and Star2 as `expecti_max_run` does them, but both outcomes of each phase are searched at
+// once. Their windows come from what's known before the phase, so each is at least as wide as
+// the serial search gives the second outcome.
+static CommandValue yb_chance(YBWorker *worker, Game *game, Command volley, int depth,
+                              double alpha, double beta) {
+    if (depth - 1 < YBWC_MIN_SPLIT_DEPTH) {
+        return yb_serial(worker, game, em_node(depth, volley, alpha, beta));
+    }
+    size_t mark = worker->frames.used;
+    YBSplit *split = ARENA_ALLOC_ARRAY(&worker->frames, YBSplit, 1);
+    YBTask *tasks = split != NULL ? ARENA_ALLOC_ARRAY(&worker->frames, YBTask, 2) : NULL;
+    if (tasks == NULL) {
+        worker->frames.used = mark;
+        return yb_serial(worker, game, em_node(depth, volley, alpha, beta));
+    }
+    worker->search->stats.chance_nodes++;
+    yb_split_init(split, game, depth, alpha, beta);
+    split->chance_command = volley;
+
+    double probs[2] = {VOLLEY_HIT_PROB, 1.0 - VOLLEY_HIT_PROB};
+    double outcome_lo[2] = {VALUE_MIN, VALUE_MIN};
+    double outcome_hi[2] = {VALUE_MAX, VALUE_MAX};
+    bool outcome_max[2];
+    for (size_t i = 0; i < 2; i++) {
+        Game outcome_game = *game;
+        game_apply_command(&outcome_game, outcome_game.turn.player, volley,
+                           i == 0 ? VOLLEY_HIT : VOLLEY_MISS);
+        outcome_max[i] = outcome_game.turn.player == PLAYER_RED;
+    }
+    double lo = VALUE_MIN;
+    double hi = VALUE_MAX;
+    for (u32 phase = 0; phase < 2 && lo < beta && hi > alpha; phase++) {
+        split->probing = phase == 0;
+        for (size_t i = 0; i < 2; i++) {
+            split->outcome_alpha[i] = (alpha - (hi - probs[i] * outcome_hi[i])) / probs[i];
+            split->outcome_beta[i] = (beta - (lo - probs[i] * outcome_lo[i])) / probs[i];
+            if (split->probing) {
+                if (outcome_max[i]) {
+                    split->outcome_alpha[i] = outcome_lo[i];
+                } else {
+                    split->outcome_beta[i] = outcome_hi[i];
+                }
+            }
+        }
+        yb_split_tasks(worker, split, tasks, 0, 1);
+        if (yb_stopped(worker->pool)) {
+            break;
+        }
+        for (size_t i = 0; i < 2; i++) {
+            double value = split->outcome_values[i];
+            if (!split->probing) {
+                outcome_lo[i] = value;
+                outcome_hi[i] = value;
+            } else if (outcome_max[i]) {
+                outcome_lo[i] = value;
+            } else {
+                outcome_hi[i] = value;
+            }
+        }
+        lo = probs[0] * outcome_lo[0] + probs[1] * outcome_lo[1];
+        hi = probs[0] * outcome_hi[0] + probs[1] * outcome_hi[1];
+    }
+    worker->frames.used = mark;
+    return (CommandValue){
+        .value = lo >= beta ? lo : hi,
+        .hit_value = outcome_lo[0],
+        .miss_value = outcome_lo[1],
+    };
+}
+
+static CommandValue yb_child(YBWorker *worker, Game *game, Command command, int depth,
+                             double alpha, double beta) {
+    worker->search->stats.children++;
+    if (command.kind == COMMAND_VOLLEY) {
+        return yb_chance(worker, game, command, depth, alpha, beta);
+    }
+    Game child = *game;
+    game_apply_command(&child, child.turn.player, command, VOLLEY_ROLL);
+    return yb_decision(worker, &child, depth - 1, alpha, beta, NULL, false, false);
+}
+
+// A younger brother. Late quiet ones are searched a ply shallower with a null window first, like
+// `expecti_max_run` reduces them.
+static CommandValue yb_brother(YBWorker *worker, YBSplit *split, size_t child_i, double alpha,
+                               double beta) {
+    Command command = split->children.commands[child_i];
+    Search *search = worker->search;
+    bool reduce = split->result == NULL && split->depth >= LMR_MIN_DEPTH &&
+                  child_i >= LMR_FULL_CHILDREN && command.kind == COMMAND_MOVE &&
+                  !command_is_capture(&split->game, command) &&
+                  !command_eq(&command, &search->killers[split->depth][0]) &&
+                  !command_eq(&command, &search->killers[split->depth][1]);
+    if (reduce) {
+        double reduced_alpha = split->min_node ? beta - NULL_WINDOW : alpha;
+        double reduced_beta = split->min_node ? beta : alpha + NULL_WINDOW;
+        CommandValue value = yb_child(worker, &split->game, command, split->depth - 1,
+                                      reduced_alpha, reduced_beta);
+        bool beats = split->min_node ? value.value < beta : value.value > alpha;
+        if (!beats || yb_stopped(worker->pool)) {
+            return value;
+        }
+    }
+    return yb_child(worker, &split->game, command, split->depth, alpha, beta);
+}
+
+static void yb_run_task(YBWorker *worker, YBTask *task) {
+    YBSplit *split = task->split;
+    if (!atomic_load_explicit(&split->cutoff, memory_order_relaxed) && !yb_stopped(worker->pool)) {
+        if (split->chance_command.kind == COMMAND_VOLLEY) {
+            yb_outcome(worker, split, task->child_i);
+        } else {
+            // Whatever the window has narrowed to by now.
+            yb_lock(split);
+            double alpha = split->alpha;
+            double beta = split->beta;
+            yb_unlock(split);
+            CommandValue value = yb_brother(worker, split, task->child_i, alpha, beta);
+            if (!yb_stopped(worker->pool)) {
+                yb_record(worker, split, task->child_i, value);
+            }
+        }
+    }
+    atomic_fetch_sub_explicit(&split->pending, 1, memory_order_release);
+}
+
+// `root` is the root's split, already set up with the result to fill in, NULL below the root.
+// `no_null` and `probe` are EMNode's.
+static CommandValue yb_decision(YBWorker *worker, Game *game, int depth, double alpha,
+                                double beta, YBSplit *root, bool no_null, bool probe) {
+    if (root == NULL && (depth < YBWC_MIN_SPLIT_DEPTH || game->status == STATUS_OVER)) {
+        EMNode node = em_node(depth, (Command){0}, alpha, beta);
+        node.no_null = no_null;
+        node.probe = probe;
+        return yb_serial(worker, game, node);
+    }
+
+    TranspositionTable *tt = worker->search->tt;
+    TTEntry tt_entry;
+    TTEntry *entry = tt_probe(tt, game->hash, &tt_entry) ? &tt_entry : NULL;
+    worker->search->stats.tt_probes++;
+    worker->search->stats.tt_hits += entry != NULL;
+    if (entry != NULL && root == NULL && entry->depth >= depth) {
+        double value = entry->value;
+        if (entry->bound == TT_BOUND_EXACT || (entry->bound == TT_BOUND_LOWER && value >= beta) ||
+            (entry->bound == TT_BOUND_UPPER && value <= alpha)) {
+            return (CommandValue){.value = value};
+        }
+    }
+
+    // Null move, verified by a shallower search of the node, as in `expecti_max_run`.
+    bool min_node = game->turn.player == PLAYER_BLUE;
+    double static_value = game_value_for_red(game);
+    if (root == NULL && !no_null && depth >= NULL_MOVE_MIN_DEPTH &&
+        (min_node ? static_value <= alpha : static_value >= beta)) {
+        Game null_game = *game;
+        game_apply_command(&null_game, null_game.turn.player,
+                           (Command){.kind = COMMAND_END_TURN}, VOLLEY_ROLL);
+        double null_alpha = min_node ? alpha : beta - NULL_WINDOW;
+        double null_beta = min_node ? alpha + NULL_WINDOW : beta;
+        double value = yb_decision(worker, &null_game, depth - 1 - NULL_MOVE_R, null_alpha,
+                                   null_beta, NULL, true, false)
+                           .value;
+        if (!yb_stopped(worker->pool) && (min_node ? value <= alpha : value >= beta)) {
+            value = yb_decision(worker, game, depth - NULL_MOVE_R, alpha, beta, NULL, true, false)
+                        .value;
+            if (!yb_stopped(worker->pool) && (min_node ? value <= alpha : value >= beta)) {
+                if (!probe) {
+                    tt_store_result(tt, game->hash, depth, value, alpha, beta, (Command){0});
+                }
+                return (CommandValue){.value = value};
+            }
+        }
+        entry = tt_probe(tt, game->hash, &tt_entry) ? &tt_entry : NULL;
+    }
+
+    size_t mark = worker->frames.used;
+    YBSplit *split = root;
+    if (split == NULL) {
+        split = ARENA_ALLOC_ARRAY(&worker->frames, YBSplit, 1);
+        if (split != NULL) {
+            yb_split_init(split, game, depth, alpha, beta);
+        }
+    }
+    Command *commands = ARENA_ALLOC_ARRAY(&worker->frames, Command, COMMANDS_MAX);
+    YBTask *tasks = ARENA_ALLOC_ARRAY(&worker->frames, YBTask, COMMANDS_MAX);
+    if (split == NULL || commands == NULL || tasks == NULL) {
+        assert(root == NULL);
+        worker->frames.used = mark;
+        EMNode node = em_node(depth, (Command){0}, alpha, beta);
+        node.no_null = true; // Already tried above.
+        node.probe = probe;
+        return yb_serial(worker, game, node);
+    }
+
+    split->children = (CommandBuf){.commands = commands, .count = 0, .capacity = COMMANDS_MAX};
+    game_valid_commands(&split->children, game);
+    assert(split->children.count > 0);
+    worker->search->stats.expanded++;
+    search_order_commands(worker->search, game, depth, &split->children, split->root_first,
+                          entry);
+
+    // The eldest brother alone, with the node's window. A probe stops there.
+    CommandValue eldest = yb_child(worker, game, split->children.commands[0], depth, alpha, beta);
+    if (!yb_stopped(worker->pool)) {
+        yb_record(worker, split, 0, eldest);
+    }
+    if (probe) {
+        worker->frames.used = mark;
+        return eldest;
+    }
+    if (split->children.count > 1 && !atomic_load(&split->cutoff) && !yb_stopped(worker->pool)) {
+        yb_split_tasks(worker, split, tasks, 1, split->children.count - 1);
+    }
+
+    CommandValue value = {.value = split->best_value};
+    worker->search->stats.cutoffs[depth] += atomic_load(&split->cutoff);
+    if (!yb_stopped(worker->pool)) {
+        tt_store_result(tt, game->hash, depth, split->best_value, split->alpha_orig,
+                        split->beta_orig, split->children.commands[split->best_child]);
+    }
+    worker->frames.used = mark;
+    return value;
+}
+
+static void yb_worker_main(void *ptr) {
+    YBWorker *worker = ptr;
+    YBPool *pool = worker->pool;
+    while (!atomic_load_explicit(&pool->done, memory_order_acquire)) {
+        YBTask *task = yb_steal(worker);
+        if (task == NULL) {
+            sched_yield();
+            continue;
+        }
+        yb_run_task(worker, task);
+    }
+}
+
+// Start `threads` - 1 helper workers, the calling thread is worker 0 and searches with `search`.
+static YBPool *yb_pool_start(AIState *state, Search *search, u32 threads) {
+    if (state->ybwc == NULL) {
+        state->ybwc = calloc(1, sizeof(YBPool));
+        assert(state->ybwc != NULL);
+    }
+    YBPool *pool = state->ybwc;
+    pool->worker_count = threads;
+    pool->threads = ai_threads_get(state);
+    atomic_store(&pool->stop, false);
+    atomic_store(&pool->done, false);
+    for (u32 i = 0; i < threads; i++) {
+        YBWorker *worker = &pool->workers[i];
+        atomic_store(&worker->deque.top, 0);
+        atomic_store(&worker->deque.bottom, 0);
+        worker->pool = pool;
+        if (i == 0) {
+            worker->search = search;
+        } else {
+            search_init(&worker->own_search, &state->tt, &state->arenas[i],
+                        state->histories[i]);
+            worker->search = &worker->own_search;
+        }
+        worker->search->stop = &pool->stop;
+        worker->search->cancel = search->cancel;
+        if (worker->frames.base == NULL) {
+            arena_init(&worker->frames, YBWC_FRAMES_SIZE);
+        }
+        worker->frames.used = 0;
+        worker->nesting = 0;
+        worker->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        pool->threads->jobs[i] = (AIJob){.run = yb_worker_main, .arg = worker};
+    }
+    ai_threads_run(pool->threads, threads);
+    return pool;
+}
+
+static void yb_pool_stop(YBPool *pool) {
+    atomic_store(&pool->done, true);
+    ai_threads_wait(pool->threads);
+}
+
+static void yb_pool_free(YBPool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    for (u32 i = 0; i < AI_MAX_THREADS; i++) {
+        arena_free(&pool->workers[i].frames);
+    }
+    free(pool);
+}
+
+// One iteration of the search on the pool, reports like `expecti_max_node`.
+static double yb_search_root(YBPool *pool, ExpectiMaxResult *result, CommandBuf *root_commands,
+                             Game *game, int depth) {
+    Search *search = pool->workers[0].search;
+    atomic_store(&pool->stop, false);
+    for (u32 i = 1; i < pool->worker_count; i++) {
+        pool->workers[i].search->deadline_ms = search->deadline_ms;
+        pool->workers[i].search->aborted = false;
+    }
+    result->best_command_i = 0;
+    result->root_children_done = 0;
+    memset(result->command_values, 0, sizeof(result->command_values));
+
+    YBSplit *root = ARENA_ALLOC_ARRAY(&pool->workers[0].frames, YBSplit, 1);
+    assert(root != NULL);
+    yb_split_init(root, game, depth, -INFINITY, INFINITY);
+    root->result = result;
+    root->root_commands = root_commands;
+    // The serial subtrees searched on worker 0 must not order by the root's first command.
+    root->root_first = search->root_first;
+    search->root_first = (Command){0};
+
+    double score =
+        yb_decision(&pool->workers[0], game, depth, -INFINITY, INFINITY, root, false, false).value;
+    search->root_first = root->root_first;
+    pool->workers[0].frames.used = 0;
+
+    if (yb_stopped(pool)) {
+        search->aborted = true;
+        score = result->root_children_done > 0
+                    ? result->command_values[result->best_command_i].value
+                    : 0.0;
+    }
+    return score;
+}
+
+// `AITurn.best_so_far` packs the score's float bits, a flag that it's set and the command index.
+#define AI_BEST_SET ((u64)1 << 31)
+
+static void ai_publish_best(AITurn *ai_turn, u32 command_i, double score) {
+    float score_f = (float)score;
+    u32 score_bits;
+    memcpy(&score_bits, &score_f, sizeof(score_bits));
+    atomic_store_explicit(&ai_turn->best_so_far, (u64)score_bits << 32 | AI_BEST_SET | command_i,
+                          memory_order_release);
+}
+
+void ai_stop(AITurn *ai_turn) {
+    atomic_store_explicit(&ai_turn->stop, true, memory_order_relaxed);
+}
+
+bool ai_best_so_far(AITurn *ai_turn, u32 *command_i, double *score) {
+    u64 best = atomic_load_explicit(&ai_turn->best_so_far, memory_order_acquire);
+    if ((best & AI_BEST_SET) == 0) {
+        return false;
+    }
+    u32 score_bits = (u32)(best >> 32);
+    float score_f;
+    memcpy(&score_f, &score_bits, sizeof(score_f));
+    *command_i = (u32)(best & (AI_BEST_SET - 1));
+    *score = score_f;
+    return true;
+}
+
+static void ai_stats_add(AIStats *stats, AIStats *add) {
+    stats->leaf_evals += add->leaf_evals;
+    stats->chance_nodes += add->chance_nodes;
+    stats->expanded += add->expanded;
+    stats->children += add->children;
+    stats->tt_probes += add->tt_probes;
+    stats->tt_hits += add->tt_hits;
+    for (u32 i = 0; i <= AI_MAX_DEPTH; i++) {
+        stats->cutoffs[i] += add->cutoffs[i];
+    }
+}
+
+// Iterative deepening, search depth 1, 2, 3... until the budget runs out. Each iteration
+// searches the previous one's best command first so an iteration cut short by the deadline
+// still returns a command at least as good as the last finished one.
+static u32 ai_select_command_iterative(AITurn *ai_turn, AIState *state, AILimits limits) {
+    Game *game = &ai_turn->game;
+    double start_ms = time_now_ms();
+
+    CommandBuf commands = {
+        .commands = ARENA_ALLOC_ARRAY(&state->arenas[0], Command, COMMANDS_MAX),
+        .count = 0,
+        .capacity = COMMANDS_MAX,
+    };
+    assert(commands.commands != NULL);
+    game_valid_commands(&commands, game);
+    assert(commands.count > 0);
+
+    // Depth 1 runs without a deadline so there's always a command to return, unless the caller
+    // stops it.
+    Search search;
+    search_init(&search, &state->tt, &state->arenas[0], state->histories[0]);
+    search.cancel = &ai_turn->stop;
+
+    bool ybwc = ai_turn->parallel == AI_PARALLEL_YBWC && limits.threads > 1 && commands.count > 1;
+    YBPool *pool = ybwc ? yb_pool_start(state, &search, limits.threads) : NULL;
+
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    AIHelper helpers[AI_MAX_THREADS];
+    u32 helper_count = commands.count > 1 && !ybwc ? limits.threads - 1 : 0;
+    AIThreads *threads = helper_count > 0 ? ai_threads_get(state) : NULL;
+    for (u32 i = 0; i < helper_count; i++) {
+        helpers[i] = (AIHelper){
+            .tt = &state->tt,
+            .arena = &state->arenas[i + 1],
+            .history = state->histories[i + 1],
+            .game = *game,
+            .thread_i = i + 1,
+            .max_depth = limits.max_depth,
+            .stop = &stop,
+            .nodes = 0,
+            .stats = {0},
+        };
+        threads->jobs[i + 1] = (AIJob){.run = ai_helper_main, .arg = &helpers[i]};
+    }
+    if (threads != NULL) {
+        ai_threads_run(threads, helper_count + 1);
+    }
+    ExpectiMaxResult result = {0};
+    u32 best_command_i = 0;
+    double best_score = 0.0;
+    ai_turn->depth_completed = 0;
+
+    for (u32 depth = 1; depth <= limits.max_depth && commands.count > 1; depth++) {
+        Game search_game = *game;
+        double score =
+            pool != NULL && depth >= YBWC_MIN_SPLIT_DEPTH
+                ? yb_search_root(pool, &result, &commands, &search_game, (int)depth)
+                : expecti_max_node(&result, &search, &search_game, (int)depth, -INFINITY,
+                                   INFINITY);
+
+        if (search.aborted) {
+            if (result.root_children_done > 0) {
+                best_command_i = result.best_command_i;
+                best_score = score;
+            }
+            break;
+        }
+        best_command_i = result.best_command_i;
+        best_score = score;
+        ai_turn->depth_completed = depth;
+        ai_publish_best(ai_turn, best_command_i, best_score);
+        search.root_first = commands.commands[best_command_i];
+
+        // A won or lost game won't change with more depth.
+        if (score >= 1.0 || score <= -1.0) {
+            break;
+        }
+        // The next iteration takes several times longer than this one, don't start it if it
+        // has no chance of finishing.
+        double elapsed_ms = time_now_ms() - start_ms;
+        if (elapsed_ms * 2 >= limits.time_budget_ms) {
+            break;
+        }
+        search.deadline_ms = start_ms + limits.time_budget_ms;
+        search.max_nodes = limits.max_nodes;
+    }
+
+    atomic_store(&stop, true);
+    ai_turn->nodes = search.nodes;
+    ai_stats_add(&ai_turn->stats, &search.stats);
+    if (threads != NULL) {
+        ai_threads_wait(threads);
+    }
+    // Helpers whose thread didn't start searched nothing.
+    for (u32 i = 0; i < helper_count; i++) {
+        ai_turn->nodes += helpers[i].nodes;
+        ai_stats_add(&ai_turn->stats, &helpers[i].stats);
+    }
+    if (pool != NULL) {
+        yb_pool_stop(pool);
+        for (u32 i = 1; i < pool->worker_count; i++) {
+            ai_turn->nodes += pool->workers[i].own_search.nodes;
+            ai_stats_add(&ai_turn->stats, &pool->workers[i].own_search.stats);
+        }
+    }
+
+    ai_turn->score = best_score;
+    return best_command_i;
+}
+
+// Whole turn search, `AITurn.plan_turns`. A ply is a turn from `game_valid_turns`, so A then B
+// and B then A are one child instead of two subtrees. A plan ending in a volley leads to a chance
+// node, after the dice the same player plans what's left of the turn as the next ply. Children
+// are ordered by the value of the position they reach. It keeps out of the TT, its depths and
+// best commands mean something else than the command search's.
+
+// Decision and chance node per ply, plus the root.
+#define TURN_STACK_MAX (2 * AI_MAX_DEPTH + 2)
+
+typedef struct {
+    float score;
+    u32 plan_i;
+} TurnOrder;
+
+// Plans of the decision node at a remaining depth. Along a path the depths only go down, so each
+// level has at most one node using it and the buffers are reused from search to search.
+typedef struct {
+    TurnPlanBuf plans;
+    TurnOrder *order; // Search order of `plans`, grown with it.
+    size_t order_capacity;
+} TurnLevel;
+
+typedef struct {
+    TurnLevel *level; // Decision nodes only, set when expanded.
+    size_t children_processed;
+    UndoCommand undo[TURN_PLAN_COMMANDS_MAX];
+    u8 undo_count;
+    bool awaiting_child;
+    int depth;
+    Command volley; // Chance nodes only, the volley that ends the parent's plan.
+    double alpha;
+    double beta;
+    double best_value;
+    size_t best_child;
+    double outcome_values[2];
+} TurnNode;
+
+struct TurnSearch {
+    TurnLevel levels[AI_MAX_DEPTH + 1];
+    TurnNode stack[TURN_STACK_MAX];
+    double values[TURN_STACK_MAX];
+    double deadline_ms;
+    u64 max_nodes;
+    atomic_bool *cancel; // `AITurn.stop`.
+    bool aborted;
+    u64 nodes;
+    AIStats stats; // Without the TT, the turn search doesn't use it.
+    TurnPlan root_first; // Searched first at the root, count 0 for none.
+    TurnPlan root_best;  // Best finished root child of the last search.
+    double root_best_value;
+    u32 root_children_done;
+};
+
+static void turn_search_free(TurnSearch *ts) {
+    if (ts == NULL) {
+        return;
+    }
+    for (u32 i = 0; i <= AI_MAX_DEPTH; i++) {
+        turn_plan_buf_free(&ts->levels[i].plans);
+        free(ts->levels[i].order);
+    }
+    free(ts);
+}
+
+static TurnNode turn_node(int depth, Command volley, double alpha, double beta) {
+    return (TurnNode){
+        .level = NULL,
+        .children_processed = 0,
+        .undo_count = 0,
+        .awaiting_child = false,
+        .depth = depth,
+        .volley = volley,
+        .alpha = alpha,
+        .beta = beta,
+        .best_value = 0.0,
+        .best_child = 0,
+        .outcome_values = {0.0, 0.0},
+    };
+}
+
+static bool turn_plan_eq(TurnPlan *a, TurnPlan *b) {
+    return a->count == b->count && a->hash == b->hash &&
+           command_eq(&a->commands[a->count - 1], &b->commands[b->count - 1]);
+}
+
+static int turn_order_cmp(const void *a, const void *b) {
+    float score_a = ((const TurnOrder *)a)->score;
+    float score_b = ((const TurnOrder *)b)->score;
+    return (score_a < score_b) - (score_a > score_b);
+}
+
+// Fill `level->order`, best plans for the side to move first. Scoring applies every plan so
+// it's only worth it above the last ply, where the children are leaves and can't be cut anyway.
+static void turn_order_plans(TurnSearch *ts, TurnLevel *level, Game *game, int depth,
+                             bool root) {
+    size_t count = level->plans.count;
+    if (level->order_capacity < count) {
+        level->order_capacity = level->plans.capacity;
+        level->order = realloc(level->order, level->order_capacity * sizeof(TurnOrder));
+        assert(level->order != NULL);
+    }
+    Player player = game->turn.player;
+    for (size_t i = 0; i < count; i++) {
+        TurnPlan *plan = &level->plans.plans[i];
+        float score = 0.0f;
+        if (root && ts->root_first.count > 0 && turn_plan_eq(plan, &ts->root_first)) {
+            score = INFINITY;
+        } else if (plan->count == 1 && plan->commands[0].kind == COMMAND_END_TURN) {
+            // Passing is rarely best, last so ties go to doing something.
+            score = -INFINITY;
+        } else if (depth > 1) {
+            UndoCommand undo[TURN_PLAN_COMMANDS_MAX];
+            u8 undo_count = 0;
+            double value = 0.0;
+            for (u8 j = 0; j < plan->count; j++) {
+                Command command = plan->commands[j];
+                if (command.kind == COMMAND_VOLLEY) {
+                    double miss_value = game_value_for_red(game);
+                    undo[undo_count++] = game_apply_command(game, player, command, VOLLEY_HIT);
+                    value = VOLLEY_HIT_PROB * game_value_for_red(game) +
+                            (1.0 - VOLLEY_HIT_PROB) * miss_value;
+                    break;
+                }
+                undo[undo_count++] = game_apply_command(game, player, command, VOLLEY_ROLL);
+                value = game_value_for_red(game);
+            }
+            while (undo_count > 0) {
+                game_undo_command(game, undo[--undo_count]);
+            }
+            score = (float)(player == PLAYER_RED ? value : -value);
+        }
+        level->order[i] = (TurnOrder){.score = score, .plan_i = (u32)i};
+    }
+    if (depth > 1 || root) {
+        qsort(level->order, count, sizeof(TurnOrder), turn_order_cmp);
+    }
+}
+
+// `expecti_max_node` with turns for plies. Chance nodes prune with Star1, the bounds of the
+// outcomes not searched yet are VALUE_MIN and VALUE_MAX. Like `expecti_max_node` it leaves
+// `game` inside the tree when it aborts.
+static double turn_max_node(TurnSearch *ts, Game *game, int depth) {
+    assert(depth <= AI_MAX_DEPTH);
+    TurnNode *stack = ts->stack;
+    uintptr_t stack_count = 0;
+    double *values = ts->values;
+    uintptr_t values_count = 0;
+    ts->root_children_done = 0;
+
+    stack[stack_count++] = turn_node(depth, (Command){0}, -INFINITY, INFINITY);
+
+    while (stack_count > 0) {
+        assert(stack_count <= TURN_STACK_MAX && values_count <= TURN_STACK_MAX);
+        uintptr_t top_i = stack_count - 1;
+        TurnNode *node = &stack[top_i];
+
+        if (node->volley.kind == COMMAND_VOLLEY) {
+            if (node->awaiting_child) {
+                values_count--;
+                game_undo_command(game, node->undo[0]);
+                node->outcome_values[node->children_processed++] = values[values_count];
+                node->awaiting_child = false;
+            } else {
+                ts->stats.chance_nodes++;
+            }
+
+            double probs[2] = {VOLLEY_HIT_PROB, 1.0 - VOLLEY_HIT_PROB};
+            double lo = 0.0;
+            double hi = 0.0;
+            for (size_t i = 0; i < 2; i++) {
+                bool searched = i < node->children_processed;
+                lo += probs[i] * (searched ? node->outcome_values[i] : VALUE_MIN);
+                hi += probs[i] * (searched ? node->outcome_values[i] : VALUE_MAX);
+            }
+            if (node->children_processed == 2 || lo >= node->beta || hi <= node->alpha) {
+                values[values_count++] = lo >= node->beta ? lo : hi;
+                stack_count--;
+                continue;
+            }
+
+            size_t i = node->children_processed;
+            VolleyResult outcome = i == 0 ? VOLLEY_HIT : VOLLEY_MISS;
+            node->undo[0] = game_apply_command(game, game->turn.player, node->volley, outcome);
+            node->awaiting_child = true;
+            double alpha = (node->alpha - (hi - probs[i] * VALUE_MAX)) / probs[i];
+            double beta = (node->beta - (lo - probs[i] * VALUE_MIN)) / probs[i];
+            stack[stack_count++] = turn_node(node->depth - 1, (Command){0}, alpha, beta);
+            continue;
+        }
+
+        if (node->level == NULL) {
+            ts->nodes++;
+            // Every node generates a few thousand plans, check the clock often.
+            bool out_of_time = (ts->nodes & 15) == 0 && ts->deadline_ms > 0 &&
+                               time_now_ms() >= ts->deadline_ms;
+            bool cancelled = atomic_load_explicit(ts->cancel, memory_order_relaxed);
+            if (out_of_time || cancelled || (ts->max_nodes > 0 && ts->nodes >= ts->max_nodes)) {
+                ts->aborted = true;
+                break;
+            }
+
+            if (node->depth == 0 || game->status == STATUS_OVER) {
+                ts->stats.leaf_evals++;
+                values[values_count++] = game_value_for_red(game);
+                stack_count--;
+                continue;
+            }
+
+            node->level = &ts->levels[node->depth];
+            game_valid_turns(&node->level->plans, game);
+            assert(node->level->plans.count > 0);
+            turn_order_plans(ts, node->level, game, node->depth, top_i == 0);
+            ts->stats.expanded++;
+            node->best_value = game->turn.player == PLAYER_BLUE ? INFINITY : -INFINITY;
+        }
+
+        TurnLevel *level = node->level;
+        if (node->awaiting_child) {
+            values_count--;
+            double value = values[values_count];
+            while (node->undo_count > 0) {
+                game_undo_command(game, node->undo[--node->undo_count]);
+            }
+            node->awaiting_child = false;
+
+            bool min_node = game->turn.player == PLAYER_BLUE;
+            size_t child_i = level->order[node->children_processed - 1].plan_i;
+            bool improved = min_node ? value < node->best_value : value > node->best_value;
+            if (improved) {
+                node->best_value = value;
+                node->best_child = child_i;
+            }
+            if (top_i == 0) {
+                ts->root_children_done++;
+                if (improved) {
+                    ts->root_best = level->plans.plans[child_i];
+                    ts->root_best_value = value;
+                }
+            }
+            if (min_node) {
+                node->beta = node->best_value < node->beta ? node->best_value : node->beta;
+            } else {
+                node->alpha = node->best_value > node->alpha ? node->best_value : node->alpha;
+            }
+            ts->stats.cutoffs[node->depth] += node->alpha >= node->beta;
+        }
+
+        if (node->children_processed < level->plans.count && node->alpha < node->beta) {
+            TurnPlan *plan = &level->plans.plans[level->order[node->children_processed].plan_i];
+            node->children_processed++;
+            ts->stats.children++;
+            node->awaiting_child = true;
+            Player player = game->turn.player;
+            bool volley = plan->commands[plan->count - 1].kind == COMMAND_VOLLEY;
+            for (u8 i = 0; i < plan->count - volley; i++) {
+                node->undo[node->undo_count++] =
+                    game_apply_command(game, player, plan->commands[i], VOLLEY_ROLL);
+            }
+            if (volley) {
+                stack[stack_count++] = turn_node(node->depth, plan->commands[plan->count - 1],
+                                                 node->alpha, node->beta);
+            } else {
+                stack[stack_count++] =
+                    turn_node(node->depth - 1, (Command){0}, node->alpha, node->beta);
+            }
+            continue;
+        }
+
+        values[values_count++] = node->best_value;
+        stack_count--;
+    }
+
+    if (ts->aborted) {
+        return 0.0;
+    }
+    assert(values_count == 1);
+    return values[0];
+}
+
+// Iterative deepening over whole turns, returns the first command of the best plan.
+static u32 ai_select_command_turns(AITurn *ai_turn, AIState *state, AILimits limits) {
+    Game *game = &ai_turn->game;
+    double start_ms = time_now_ms();
+    if (state->turns == NULL) {
+        state->turns = calloc(1, sizeof(TurnSearch));
+        assert(state->turns != NULL);
+    }
+    TurnSearch *ts = state->turns;
+    ts->deadline_ms = 0;
+    ts->max_nodes = 0;
+    ts->cancel = &ai_turn->stop;
+    ts->aborted = false;
+    ts->nodes = 0;
+    ts->stats = (AIStats){0};
+    ts->root_first.count = 0;
+
+    CommandBuf commands = {
+        .commands = ARENA_ALLOC_ARRAY(&state->arenas[0], Command, COMMANDS_MAX),
+        .count = 0,
+        .capacity = COMMANDS_MAX,
+    };
+    assert(commands.commands != NULL);
+    game_valid_commands(&commands, game);
+    assert(commands.count > 0);
+
+    TurnPlan best = {0};
+    ai_turn->depth_completed = 0;
+    ai_turn->score = 0.0;
+    for (u32 depth = 1; depth <= limits.max_depth; depth++) {
+        Game search_game = *game;
+        double score = turn_max_node(ts, &search_game, (int)depth);
+        if (ts->root_children_done > 0) {
+            best = ts->root_best;
+            ai_turn->score = ts->root_best_value;
+        }
+        if (ts->aborted) {
+            break;
+        }
+        ai_turn->depth_completed = depth;
+        ai_publish_best(ai_turn, command_index(&commands, &best.commands[0]), ai_turn->score);
+        ts->root_first = best;
+
+        if (score >= 1.0 || score <= -1.0 || ts->levels[depth].plans.count == 1) {
+            break;
+        }
+        double elapsed_ms = time_now_ms() - start_ms;
+        if (elapsed_ms * 2 >= limits.time_budget_ms) {
+            break;
+        }
+        ts->deadline_ms = start_ms + limits.time_budget_ms;
+        ts->max_nodes = limits.max_nodes;
+    }
+
+    ai_turn->nodes = ts->nodes;
+    ai_stats_add(&ai_turn->stats, &ts->stats);
+    ts->root_first = best; // For `ai_plan_build`, empty if there's no plan.
+    if (best.count == 0) {
+        // Stopped before any root child finished, the first command like the command search.
+        return 0;
+    }
+    return command_index(&commands, &best.commands[0]);
+}
+
+// Monte Carlo tree search.
+// Each playout walks down the tree by UCT, grows it by at most one node's children and plays
+// random commands from there before scoring the position with `game_value_for_red`. A volley
+// leads to a chance node whose two children are the hit and the miss, visited in proportion to
+// VOLLEY_HIT_PROB. Nodes come from a fixed pool with a free list. The tree is kept in the AI
+// state, and the next call starts from the node for its position if the tree has one, so the
+// commands of one turn and the opponent's reply reuse what earlier calls searched.
+
+#define MCTS_NODE_NONE UINT32_MAX
+#define MCTS_POOL_NODES (1 << 19)
+// A node's children are only created once it has had this many playouts.
+#define MCTS_EXPAND_VISITS 8
+#define MCTS_PLAYOUT_COMMANDS 16
+#define MCTS_EXPLORATION 0.7
+#define MCTS_MAX_PATH 512
+// How far below the old root the new position is looked for, a whole turn of the opponent
+// with a chance node for each volley fits.
+#define MCTS_REUSE_DEPTH 12
+
+static CPos cpos_unpack(u32 slot) {
+    i32 q = (i32)(slot % 9) - 4;
+    i32 r = (i32)(slot / 9) - 4;
+    return (CPos){q, r, -q - r};
+}
+
+static Command command_unpack(u16 packed) {
+    return (Command){
+        .kind = (CommandKind)(packed >> 14),
+        .piece_pos = cpos_unpack(packed >> 7 & 0x7f),
+        .target_pos = cpos_unpack(packed & 0x7f),
+    };
+}
+
+static u32 mcts_alloc(MCTSTree *tree, u32 parent, u16 command, MCTSNodeKind kind,
+                      VolleyResult outcome) {
+    u32 n = tree->free_list;
+    if (n != MCTS_NODE_NONE) {
+        tree->free_list = tree->nodes[n].next_sibling;
+    } else if (tree->used < MCTS_POOL_NODES) {
+        n = tree->used++;
+    } else {
+        return MCTS_NODE_NONE;
+    }
+    tree->nodes[n] = (MCTSNode){
+        .hash = 0,
+        .parent = parent,
+        .first_child = MCTS_NODE_NONE,
+        .next_sibling = MCTS_NODE_NONE,
+        .visits = 0,
+        .value = 0.0f,
+        .command = command,
+        .kind = kind,
+        .outcome = (u8)outcome,
+        .expanded = false,
+    };
+    return n;
+}
+
+// Return `n` and everything below it to the free list. The pending nodes are chained through
+// `next_sibling`, so no stack is needed.
+static void mcts_free_subtree(MCTSTree *tree, u32 n) {
+    tree->nodes[n].next_sibling = MCTS_NODE_NONE;
+    u32 pending = n;
+    while (pending != MCTS_NODE_NONE) {
+        MCTSNode *node = &tree->nodes[pending];
+        u32 next = node->next_sibling;
+        if (node->first_child != MCTS_NODE_NONE) {
+            u32 last = node->first_child;
+            while (tree->nodes[last].next_sibling != MCTS_NODE_NONE) {
+                last = tree->nodes[last].next_sibling;
+            }
+            tree->nodes[last].next_sibling = next;
+            next = node->first_child;
+        }
+        node->next_sibling = tree->free_list;
+        tree->free_list = pending;
+        pending = next;
+    }
+}
+
+// Prepend children in reverse so they end up in `game_valid_commands` order.
+static void mcts_add_child(MCTSTree *tree, u32 parent, u32 child) {
+    tree->nodes[child].next_sibling = tree->nodes[parent].first_child;
+    tree->nodes[parent].first_child = child;
+}
+
+static void mcts_expand(MCTSTree *tree, u32 n, Game *game, CommandBuf *commands) {
+    MCTSNode *node = &tree->nodes[n];
+    node->expanded = true;
+    if (node->kind == MCTS_NODE_CHANCE) {
+        u32 miss = mcts_alloc(tree, n, node->command, MCTS_NODE_DECISION, VOLLEY_MISS);
+        u32 hit = mcts_alloc(tree, n, node->command, MCTS_NODE_DECISION, VOLLEY_HIT);
+        if (hit == MCTS_NODE_NONE || miss == MCTS_NODE_NONE) {
+            // Out of nodes, a chance node with one outcome would skew every value above it.
+            if (hit != MCTS_NODE_NONE) {
+                mcts_free_subtree(tree, hit);
+            }
+            if (miss != MCTS_NODE_NONE) {
+                mcts_free_subtree(tree, miss);
+            }
+            tree->nodes[n].expanded = false;
+            return;
+        }
+        mcts_add_child(tree, n, miss);
+        mcts_add_child(tree, n, hit);
+        return;
+    }
+    game_valid_commands(commands, game);
+    for (size_t i = commands->count; i-- > 0;) {
+        Command command = commands->commands[i];
+        MCTSNodeKind kind =
+            command.kind == COMMAND_VOLLEY ? MCTS_NODE_CHANCE : MCTS_NODE_DECISION;
+        u32 child = mcts_alloc(tree, n, command_pack(command), kind, VOLLEY_ROLL);
+        if (child == MCTS_NODE_NONE) {
+            // Out of nodes, the commands left out would never be tried. Expand it again once
+            // re-rooting frees some, until then playouts start here.
+            while (tree->nodes[n].first_child != MCTS_NODE_NONE) {
+                u32 added = tree->nodes[n].first_child;
+                tree->nodes[n].first_child = tree->nodes[added].next_sibling;
+                mcts_free_subtree(tree, added);
+            }
+            tree->nodes[n].expanded = false;
+            return;
+        }
+        mcts_add_child(tree, n, child);
+    }
+}
+
+static u32 mcts_select_uct(MCTSTree *tree, u32 n, Player player) {
+    MCTSNode *node = &tree->nodes[n];
+    double log_visits = log((double)node->visits + 1.0);
+    u32 best = MCTS_NODE_NONE;
+    double best_score = -INFINITY;
+    for (u32 c = node->first_child; c != MCTS_NODE_NONE; c = tree->nodes[c].next_sibling) {
+        MCTSNode *child = &tree->nodes[c];
+        if (child->visits == 0) {
+            return c;
+        }
+        double mean = (double)child->value / child->visits;
+        if (player == PLAYER_BLUE) {
+            mean = -mean;
+        }
+        double score = mean + MCTS_EXPLORATION * sqrt(log_visits / child->visits);
+        if (score > best_score) {
+            best_score = score;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Keep each outcome's share of the visits close to its probability.
+static u32 mcts_select_outcome(MCTSTree *tree, u32 n) {
+    u32 hit = tree->nodes[n].first_child;
+    u32 miss = tree->nodes[hit].next_sibling;
+    double hit_target = VOLLEY_HIT_PROB * (tree->nodes[n].visits + 1);
+    return tree->nodes[hit].visits < hit_target ? hit : miss;
+}
+
+static double mcts_playout(Game *game, CommandBuf *commands) {
+    for (u32 i = 0; i < MCTS_PLAYOUT_COMMANDS && game->status == STATUS_IN_PROGRESS; i++) {
+        game_valid_commands(commands, game);
+        Command command = commands->commands[rand_in_range(0, (u32)commands->count)];
+        game_apply_command(game, game->turn.player, command, VOLLEY_ROLL);
+    }
+    return game_value_for_red(game);
+}
+
+static void mcts_iterate(MCTSTree *tree, CommandBuf *commands, u32 *path) {
+    Game game = tree->game;
+    u32 path_count = 0;
+    u32 n = tree->root;
+    path[path_count++] = n;
+
+    while (path_count < MCTS_MAX_PATH) {
+        MCTSNode *node = &tree->nodes[n];
+        if (node->kind == MCTS_NODE_DECISION) {
+            if (game.status == STATUS_OVER) {
+                break;
+            }
+            if (!node->expanded) {
+                if (node->visits < MCTS_EXPAND_VISITS && n != tree->root) {
+                    break;
+                }
+                mcts_expand(tree, n, &game, commands);
+            }
+            u32 child = mcts_select_uct(tree, n, game.turn.player);
+            if (child == MCTS_NODE_NONE) {
+                break;
+            }
+            if (tree->nodes[child].kind == MCTS_NODE_DECISION) {
+                game_apply_command(&game, game.turn.player,
+                                   command_unpack(tree->nodes[child].command), VOLLEY_ROLL);
+            }
+            n = child;
+        } else {
+            // Chance nodes always go on to an outcome, the volley can't be played out unrolled.
+            if (!node->expanded) {
+                mcts_expand(tree, n, &game, commands);
+                if (!node->expanded) {
+                    // Out of nodes, roll the dice for real and play out from there.
+                    game_apply_command(&game, game.turn.player, command_unpack(node->command),
+                                       VOLLEY_ROLL);
+                    break;
+                }
+            }
+            n = mcts_select_outcome(tree, n);
+            game_apply_command(&game, game.turn.player, command_unpack(tree->nodes[n].command),
+                               (VolleyResult)tree->nodes[n].outcome);
+        }
+        tree->nodes[n].hash = game.hash;
+        path[path_count++] = n;
+        if (tree->nodes[n].visits == 0 && tree->nodes[n].kind == MCTS_NODE_DECISION) {
+            break;
+        }
+    }
+
+    double value = mcts_playout(&game, commands);
+    for (u32 i = 0; i < path_count; i++) {
+        tree->nodes[path[i]].visits++;
+        tree->nodes[path[i]].value += (float)value;
+    }
+}
+
+// Replay the commands from the root to `n` and check it really is `game`, the hash could collide.
+static bool mcts_node_is_game(MCTSTree *tree, u32 n, Game *game) {
+    u32 path[MCTS_REUSE_DEPTH + 1];
+    u32 path_count = 0;
+    for (u32 i = n; i != tree->root; i = tree->nodes[i].parent) {
+        if (path_count == MCTS_REUSE_DEPTH + 1) {
+            return false;
+        }
+        path[path_count++] = i;
+    }
+    Game replay = tree->game;
+    while (path_count > 0) {
+        MCTSNode *node = &tree->nodes[path[--path_count]];
+        if (node->kind == MCTS_NODE_DECISION) {
+            game_apply_command(&replay, replay.turn.player, command_unpack(node->command),
+                               (VolleyResult)node->outcome);
+        }
+    }
+    return game_eq(&replay, game);
+}
+
+// Depth first through the top of the tree, following the parent links back up.
+static u32 mcts_find(MCTSTree *tree, Game *game) {
+    u32 n = tree->root;
+    u32 depth = 0;
+    for (;;) {
+        MCTSNode *node = &tree->nodes[n];
+        if (node->kind == MCTS_NODE_DECISION && node->visits > 0 && node->hash == game->hash &&
+            mcts_node_is_game(tree, n, game)) {
+            return n;
+        }
+        if (depth < MCTS_REUSE_DEPTH && node->first_child != MCTS_NODE_NONE &&
+            node->visits > 0) {
+            n = node->first_child;
+            depth++;
+            continue;
+        }
+        while (n != tree->root && tree->nodes[n].next_sibling == MCTS_NODE_NONE) {
+            n = tree->nodes[n].parent;
+            depth--;
+        }
+        if (n == tree->root) {
+            return MCTS_NODE_NONE;
+        }
+        n = tree->nodes[n].next_sibling;
+    }
+}
+
+// Move the root to `game`, keeping the subtree that already searched it.
+static void mcts_set_root(MCTSTree *tree, Game *game) {
+    if (tree->nodes == NULL) {
+        tree->nodes = malloc(MCTS_POOL_NODES * sizeof(MCTSNode));
+        assert(tree->nodes != NULL);
+        tree->used = 0;
+        tree->free_list = MCTS_NODE_NONE;
+        tree->root = MCTS_NODE_NONE;
+    }
+    u32 keep = MCTS_NODE_NONE;
+    if (tree->root != MCTS_NODE_NONE) {
+        keep = mcts_find(tree, game);
+        if (keep != tree->root) {
+            if (keep != MCTS_NODE_NONE) {
+                // Unlink it so freeing the old root leaves it alone.
+                u32 parent = tree->nodes[keep].parent;
+                u32 *link = &tree->nodes[parent].first_child;
+                while (*link != keep) {
+                    link = &tree->nodes[*link].next_sibling;
+                }
+                *link = tree->nodes[keep].next_sibling;
+                tree->nodes[keep].parent = MCTS_NODE_NONE;
+                tree->nodes[keep].next_sibling = MCTS_NODE_NONE;
+            }
+            mcts_free_subtree(tree, tree->root);
+        }
+    }
+    if (keep == MCTS_NODE_NONE) {
+        keep = mcts_alloc(tree, MCTS_NODE_NONE, 0, MCTS_NODE_DECISION, VOLLEY_ROLL);
+        assert(keep != MCTS_NODE_NONE);
+        tree->nodes[keep].hash = game->hash;
+    }
+    tree->root = keep;
+    tree->game = *game;
+}
+
+// The root's most visited child, the most trusted value. MCTS_NODE_NONE if it has none.
+static u32 mcts_best_child(MCTSTree *tree) {
+    u32 best = MCTS_NODE_NONE;
+    for (u32 c = tree->nodes[tree->root].first_child; c != MCTS_NODE_NONE;
+         c = tree->nodes[c].next_sibling) {
+        if (best == MCTS_NODE_NONE || tree->nodes[c].visits > tree->nodes[best].visits) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Playouts between publishing the best command so far.
+#define MCTS_PUBLISH_PLAYOUTS 1024
+
+static u32 ai_select_command_mcts(AITurn *ai_turn, AIState *state, AILimits limits) {
+    Game *game = &ai_turn->game;
+    MCTSTree *tree = &state->mcts;
+    double deadline_ms = time_now_ms() + limits.time_budget_ms;
+
+    CommandBuf root_commands = {
+        .commands = ARENA_ALLOC_ARRAY(&state->arenas[0], Command, COMMANDS_MAX),
+        .count = 0,
+        .capacity = COMMANDS_MAX,
+    };
+    CommandBuf commands = {
+        .commands = ARENA_ALLOC_ARRAY(&state->arenas[0], Command, COMMANDS_MAX),
+        .count = 0,
+        .capacity = COMMANDS_MAX,
+    };
+    u32 *path = ARENA_ALLOC_ARRAY(&state->arenas[0], u32, MCTS_MAX_PATH);
+    assert(root_commands.commands != NULL && commands.commands != NULL && path != NULL);
+    game_valid_commands(&root_commands, game);
+    assert(root_commands.count > 0);
+    ai_turn->depth_completed = 0;
+    ai_turn->score = 0.0;
+    ai_turn->nodes = 0;
+    if (root_commands.count == 1) {
+        return 0;
+    }
+
+    mcts_set_root(tree, game);
+    u32 playouts = 0;
+    for (;; playouts++) {
+        if (limits.playouts != 0) {
+            if (playouts >= limits.playouts) {
+                break;
+            }
+        } else if ((playouts & 15) == 0 && time_now_ms() >= deadline_ms) {
+            break;
+        }
+        if ((playouts & 15) == 0 && atomic_load_explicit(&ai_turn->stop, memory_order_relaxed)) {
+            break;
+        }
+        if (playouts > 0 && playouts % MCTS_PUBLISH_PLAYOUTS == 0) {
+            u32 best = mcts_best_child(tree);
+            if (best != MCTS_NODE_NONE && tree->nodes[best].visits > 0) {
+                Command best_command = command_unpack(tree->nodes[best].command);
+                ai_publish_best(ai_turn, command_index(&root_commands, &best_command),
+                                tree->nodes[best].value / (double)tree->nodes[best].visits);
+            }
+        }
+        mcts_iterate(tree, &commands, path);
+    }
+    ai_turn->nodes = playouts;
+    ai_turn->stats.leaf_evals = playouts;
+
+    u32 best = mcts_best_child(tree);
+    if (best == MCTS_NODE_NONE) {
+        return 0;
+    }
+    if (tree->nodes[best].visits > 0) {
+        ai_turn->score = tree->nodes[best].value / (double)tree->nodes[best].visits;
+    }
+    Command best_command = command_unpack(tree->nodes[best].command);
+    return command_index(&root_commands, &best_command);
+}
+
+// Turn plan. The AI is asked for one command at a time, but a search from the first command of
+// the turn has already seen the rest. After each search the line it prefers is walked to the end
+// of the turn and kept, so the next calls of the turn answer from it without searching. The root
+// takes the selected command, or the turn search's whole plan, the positions after it the TT's
+// best command. Both outcomes of a volley are kept so the real roll finds its position either
+// way. A position the walk reached without a command, an outcome the search barely looked at,
+// is searched again with a shorter budget.
+
+// Of the budget, for positions the plan reached without a command.
+#define AI_PLAN_RESEARCH_DIV 4
+
+static bool ai_limits_eq(AILimits *a, AILimits *b) {
+    return a->time_budget_ms == b->time_budget_ms && a->max_depth == b->max_depth &&
+           a->threads == b->threads && a->playouts == b->playouts &&
+           a->max_nodes == b->max_nodes;
+}
+
+static bool command_buf_contains(CommandBuf *command_buf, Command *command) {
+    for (size_t i = 0; i < command_buf->count; i++) {
+        if (command_eq(&command_buf->commands[i], command)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replace `state->plan` with the rest of the turn from `ai_turn->game`. `turn` is the plan the
+// turn search chose, empty if it was stopped first, NULL for the command search, which starts
+// with the selected command and goes on with the TT's. Only entries the search of this line
+// would have left count, an exact or lower bound at least as deep as what was left of the root's
+// depth there. An upper bound's command is just the last one tried, a shallower entry is from
+// some other search.
+static void ai_plan_build(AIState *state, AITurn *ai_turn, AILimits limits, TurnPlan *turn) {
+    AIPlan *plan = &state->plan;
+    plan->count = 0;
+    plan->difficulty = ai_turn->difficulty;
+    plan->plan_turns = ai_turn->plan_turns;
+    plan->limits = limits;
+    plan->depth_completed = ai_turn->depth_completed;
+    if (turn != NULL && turn->count == 0) {
+        return; // The turn search was stopped before it had a plan.
+    }
+
+    typedef struct {
+        Game game;
+        u32 line_i; // Next command of `line`, line_count once off it.
+        int depth;  // Left of the root search's depth_completed, a volley's outcomes take one.
+    } PlanWalk;
+    PlanWalk stack[AI_PLAN_STEPS_MAX];
+    u32 stack_count = 0;
+    u32 line_count = turn != NULL ? turn->count : 0;
+    stack[stack_count++] =
+        (PlanWalk){.game = ai_turn->game, .line_i = 0, .depth = (int)ai_turn->depth_completed};
+    Player player = ai_turn->game.turn.player;
+    CommandBuf commands = {0};
+
+    while (stack_count > 0 && plan->count < AI_PLAN_STEPS_MAX) {
+        PlanWalk walk = stack[--stack_count];
+        Game *game = &walk.game;
+        if (game->status != STATUS_IN_PROGRESS || game->turn.player != player) {
+            continue;
+        }
+
+        game_valid_commands(&commands, game);
+        AIPlanStep *step = &plan->steps[plan->count];
+        *step = (AIPlanStep){.hash = game->hash, .command = {0}, .score = ai_turn->score};
+        TTEntry entry;
+        if (walk.line_i < line_count) {
+            step->command = turn->commands[walk.line_i];
+        } else if (turn == NULL && plan->count == 0) {
+            step->command = commands.commands[ai_turn->selected_command_i];
+        } else if (turn == NULL && walk.depth > 0 && tt_probe(&state->tt, game->hash, &entry) &&
+                   (entry.bound == TT_BOUND_EXACT || entry.bound == TT_BOUND_LOWER) &&
+                   entry.depth >= walk.depth) {
+            step->command = command_unpack(entry.best_command);
+            step->score = entry.value;
+        }
+        plan->count++;
+        if (step->command.kind == COMMAND_NONE ||
+            !command_buf_contains(&commands, &step->command)) {
+            step->command = (Command){0};
+            continue;
+        }
+
+        if (step->command.kind == COMMAND_VOLLEY) {
+            // A turn plan ends with its volley, the outcomes are its next ply.
+            for (u32 i = 0; i < 2 && stack_count < AI_PLAN_STEPS_MAX; i++) {
+                PlanWalk *outcome = &stack[stack_count++];
+                *outcome =
+                    (PlanWalk){.game = *game, .line_i = line_count, .depth = walk.depth - 1};
+                game_apply_command(&outcome->game, player, step->command,
+                                   i == 0 ? VOLLEY_HIT : VOLLEY_MISS);
+            }
+        } else {
+            PlanWalk *next = &stack[stack_count++];
+            *next = (PlanWalk){.game = *game, .line_i = walk.line_i + 1, .depth = walk.depth - 1};
+            game_apply_command(&next->game, player, step->command, VOLLEY_ROLL);
+        }
+    }
+    free(commands.commands);
+}
+
+// Answer `ai_turn` from the plan of an earlier search. Sets `*diverged` when the plan reached the
+// position but has no command for it.
+static bool ai_plan_answer(AITurn *ai_turn, AILimits limits, bool *diverged) {
+    *diverged = false;
+    AIState *state = ai_turn->ai_state;
+    if (state == NULL || ai_turn->ponder) {
+        return false;
+    }
+    AIPlan *plan = &state->plan;
+    if (plan->difficulty != ai_turn->difficulty || plan->plan_turns != ai_turn->plan_turns ||
+        !ai_limits_eq(&plan->limits, &limits)) {
+        return false;
+    }
+    Game *game = &ai_turn->game;
+    for (u32 i = 0; i < plan->count; i++) {
+        AIPlanStep *step = &plan->steps[i];
+        if (step->hash != game->hash) {
+            continue;
+        }
+        if (step->command.kind == COMMAND_NONE) {
+            *diverged = true;
+            return false;
+        }
+        CommandBuf commands = {0};
+        game_valid_commands(&commands, game);
+        bool found = command_buf_contains(&commands, &step->command);
+        if (found) {
+            ai_turn->selected_command_i = command_index(&commands, &step->command);
+            ai_turn->score = step->score;
+            ai_turn->depth_completed = plan->depth_completed;
+            ai_turn->nodes = 0;
+            ai_turn->planned = true;
+        }
+        free(commands.commands);
+        return found;
+    }
+    return false;
+}
+
+// Opening book file. A header then entries sorted by hash, in the byte order of the machine that
+// wrote it, little endian everywhere the game runs. Probes binary search the entries in place.
+#define AI_BOOK_MAGIC 0x4b425a54 // "TZBK"
+#define AI_BOOK_VERSION 1
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 count;
+} AIBookHeader;
+
+typedef struct {
+    u64 hash;
+    u16 command; // Packed with `command_pack`.
+    i16 score;   // For red, times AI_BOOK_SCORE_SCALE.
+    u16 depth;
+    u16 unused;
+} AIBookSlot;
+
+#define AI_BOOK_SCORE_SCALE 32767.0
+
+struct AIBook {
+    void *data; // The whole file.
+    size_t size;
+    bool mapped; // With mmap, read into a malloc otherwise.
+    const AIBookSlot *slots;
+    u64 count;
+};
+
+AIBook *ai_book_open(const char *path) {
+    void *data = NULL;
+    size_t size = 0;
+    bool mapped = false;
+#ifdef AI_BOOK_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(AIBookHeader)) {
+        size = (size_t)st.st_size;
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapped = data != MAP_FAILED;
+        data = mapped ? data : NULL;
+    }
+    close(fd);
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long end = ftell(file);
+        size = end > 0 ? (size_t)end : 0;
+    }
+    if (size >= sizeof(AIBookHeader) && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(size);
+        if (data != NULL && fread(data, 1, size, file) != size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+#endif
+    if (data == NULL) {
+        return NULL;
+    }
+
+    AIBook *book = malloc(sizeof(AIBook));
+    assert(book != NULL);
+    *book = (AIBook){.data = data, .size = size, .mapped = mapped};
+    AIBookHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != AI_BOOK_MAGIC || header.version != AI_BOOK_VERSION ||
+        header.count > (size - sizeof(header)) / sizeof(AIBookSlot)) {
+        ai_book_close(book);
+        return NULL;
+    }
+    book->slots = (const AIBookSlot *)((const u8 *)data + sizeof(header));
+    book->count = header.count;
+    return book;
+}
+
+void ai_book_close(AIBook *book) {
+    if (book == NULL) {
+        return;
+    }
+#ifdef AI_BOOK_MMAP
+    if (book->mapped) {
+        munmap(book->data, book->size);
+    }
+#endif
+    if (!book->mapped) {
+        free(book->data);
+    }
+    free(book);
+}
+
+bool ai_book_probe(const AIBook *book, Game *game, AIBookEntry *entry) {
+    u64 lo = 0;
+    u64 hi = book->count;
+    while (lo < hi) {
+        u64 mid = lo + (hi - lo) / 2;
+        if (book->slots[mid].hash < game->hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == book->count || book->slots[lo].hash != game->hash) {
+        return false;
+    }
+    const AIBookSlot *slot = &book->slots[lo];
+    *entry = (AIBookEntry){
+        .hash = slot->hash,
+        .command = command_unpack(slot->command),
+        .score = slot->score / AI_BOOK_SCORE_SCALE,
+        .depth = slot->depth,
+    };
+    return true;
+}
+
+static int ai_book_slot_cmp(const void *a, const void *b) {
+    u64 ha = ((const AIBookSlot *)a)->hash;
+    u64 hb = ((const AIBookSlot *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+bool ai_book_write(const char *path, AIBookEntry *entries, size_t count) {
+    AIBookSlot *slots = calloc(count > 0 ? count : 1, sizeof(AIBookSlot));
+    assert(slots != NULL);
+    for (size_t i = 0; i < count; i++) {
+        double score = fmin(fmax(entries[i].score, -1.0), 1.0);
+        slots[i] = (AIBookSlot){
+            .hash = entries[i].hash,
+            .command = command_pack(entries[i].command),
+            .score = (i16)lround(score * AI_BOOK_SCORE_SCALE),
+            .depth = (u16)entries[i].depth,
+            .unused = 0,
+        };
+    }
+    qsort(slots, count, sizeof(AIBookSlot), ai_book_slot_cmp);
+
+    AIBookHeader header = {.magic = AI_BOOK_MAGIC, .version = AI_BOOK_VERSION, .count = count};
+    FILE *file = fopen(path, "wb");
+    bool ok = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(slots, sizeof(AIBookSlot), count, file) == count;
+    if (file != NULL) {
+        ok = fclose(file) == 0 && ok;
+    }
+    free(slots);
+    return ok;
+}
+
+// Answer `ai_turn` from its book if the position is in it. Hard only, the book's commands come
+// from searches far deeper than easy or medium are allowed.
+static bool ai_book_answer(AITurn *ai_turn) {
+    if (ai_turn->book == NULL || ai_turn->difficulty != AIDIFF_HARD || ai_turn->ponder ||
+        ai_turn->search_always) {
+        return false;
+    }
+    AIBookEntry entry;
+    if (!ai_book_probe(ai_turn->book, &ai_turn->game, &entry)) {
+        return false;
+    }
+    CommandBuf commands = {0};
+    game_valid_commands(&commands, &ai_turn->game);
+    // A hash collision with a position outside the book could name any command.
+    bool found = command_buf_contains(&commands, &entry.command);
+    if (found) {
+        ai_turn->selected_command_i = command_index(&commands, &entry.command);
+        ai_turn->score = entry.score;
+        ai_turn->depth_completed = entry.depth;
+        ai_turn->nodes = 0;
+        ai_turn->from_book = true;
+    }
+    free(commands.commands);
+    return found;
+}
+
+// Publish the selected command and fill in the stats that depend on the whole call.
+static void ai_select_command_done(AITurn *ai_turn, double start_ms) {
+    ai_publish_best(ai_turn, ai_turn->selected_command_i, ai_turn->score);
+    AIStats *stats = &ai_turn->stats;
+    stats->branching =
+        stats->expanded > 0 ? (double)stats->children / (double)stats->expanded : 0.0;
+    stats->elapsed_ms = time_now_ms() - start_ms;
+    stats->nps =
+        stats->elapsed_ms > 0.0 ? (double)ai_turn->nodes * 1000.0 / stats->elapsed_ms : 0.0;
+}
+
+int ai_select_command(void *ptr) {
+    AITurn *ai_turn = (AITurn *)ptr;
+    double start_ms = time_now_ms();
+    ai_turn->stats = (AIStats){0};
+    ai_turn->planned = false;
+    ai_turn->from_book = false;
+    atomic_store_explicit(&ai_turn->best_so_far, 0, memory_order_relaxed);
+    if (ai_book_answer(ai_turn)) {
+        ai_select_command_done(ai_turn, start_ms);
+        return 0;
+    }
+    switch (ai_turn->difficulty) {
+    case AIDIFF_EASY:
+    case AIDIFF_MEDIUM:
+    case AIDIFF_HARD: {
+        AILimits limits = ai_difficulty_limits(ai_turn->difficulty);
+        if (ai_turn->time_budget_ms != 0) {
+            limits.time_budget_ms = ai_turn->time_budget_ms;
+        }
+        if (ai_turn->max_depth != 0) {
+            limits.max_depth = ai_turn->max_depth < AI_MAX_DEPTH ? ai_turn->max_depth
+                                                                 : AI_MAX_DEPTH;
+        }
+        if (ai_turn->threads != 0) {
+            limits.threads = ai_turn->threads < AI_MAX_THREADS ? ai_turn->threads
+                                                               : AI_MAX_THREADS;
+        }
+        limits.max_nodes = ai_turn->max_nodes;
+        if (ai_turn->ponder) {
+            limits.time_budget_ms = UINT32_MAX;
+            limits.max_depth = AI_MAX_DEPTH;
+            limits.max_nodes = 0;
+        }
+        bool diverged = false;
+        if (!ai_turn->search_always && ai_plan_answer(ai_turn, limits, &diverged)) {
+            break;
+        }
+        AILimits search_limits = limits;
+        if (diverged) {
+            search_limits.time_budget_ms = limits.time_budget_ms / AI_PLAN_RESEARCH_DIV + 1;
+            if (limits.max_nodes > 0) {
+                search_limits.max_nodes = limits.max_nodes / AI_PLAN_RESEARCH_DIV + 1;
+            }
+        }
+        AIState *state = ai_state_get(ai_turn, limits.threads);
+        ai_turn->selected_command_i =
+            ai_turn->plan_turns ? ai_select_command_turns(ai_turn, state, search_limits)
+                                : ai_select_command_iterative(ai_turn, state, search_limits);
+        // A ponder searches the opponent's turn, the plan stays the AI's.
+        if (!ai_turn->ponder) {
+            ai_plan_build(state, ai_turn, limits,
+                          ai_turn->plan_turns ? &state->turns->root_first : NULL);
+        }
+        break;
+    }
+    case AIDIFF_MCTS: {
+        AILimits limits = ai_difficulty_limits(ai_turn->difficulty);
+        if (ai_turn->time_budget_ms != 0) {
+            limits.time_budget_ms = ai_turn->time_budget_ms;
+        }
+        limits.playouts = ai_turn->ponder ? 0 : ai_turn->playouts;
+        if (ai_turn->ponder) {
+            limits.time_budget_ms = UINT32_MAX;
+        }
+        AIState *state = ai_state_get(ai_turn, limits.threads);
+        ai_turn->selected_command_i = ai_select_command_mcts(ai_turn, state, limits);
+        break;
+    }
+    default:
+        assert(false);
+        return -1;
+    }
+
+    ai_select_command_done(ai_turn, start_ms);
+    return 0;
+}
+
+bool ai_stats_append_json(const char *path, AITurn *ai_turn) {
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        return false;
+    }
+    AIStats *stats = &ai_turn->stats;
+    fprintf(file,
+            "{\"difficulty\":%d,\"plan_turns\":%s,\"planned\":%s,\"from_book\":%s,"
+            "\"depth\":%u,\"score\":%.4f,"
+            "\"nodes\":%" PRIu64 ",\"leaf_evals\":%" PRIu64 ",\"chance_nodes\":%" PRIu64
+            ",\"expanded\":%" PRIu64 ",\"children\":%" PRIu64 ",\"branching\":%.3f,"
+            "\"tt_probes\":%" PRIu64 ",\"tt_hits\":%" PRIu64 ",\"cutoffs\":[",
+            (int)ai_turn->difficulty, ai_turn->plan_turns ? "true" : "false",
+            ai_turn->planned ? "true" : "false", ai_turn->from_book ? "true" : "false",
+            ai_turn->depth_completed, ai_turn->score, ai_turn->nodes, stats->leaf_evals,
+            stats->chance_nodes, stats->expanded, stats->children, stats->branching,
+            stats->tt_probes, stats->tt_hits);
+    // Up to the deepest depth with a cutoff, index i is i plies from the leaves.
+    u32 depths = AI_MAX_DEPTH + 1;
+    while (depths > 0 && stats->cutoffs[depths - 1] == 0) {
+        depths--;
+    }
+    for (u32 i = 0; i < depths; i++) {
+        fprintf(file, "%s%" PRIu64, i == 0 ? "" : ",", stats->cutoffs[i]);
+    }
+    fprintf(file, "],\"elapsed_ms\":%.1f,\"nps\":%.0f}\n", stats->elapsed_ms, stats->nps);
+    return fclose(file) == 0;
 }
@@ -0,0 +1,236 @@
+// Opening book builder.
+//
+// The attrition start from `game_init` is the same every game, so its first commands can be
+// searched once offline, deeper than any live budget, and looked up for free with `ai_book_open`.
+// Positions are walked breadth first from the start and each is searched with every core. The
+// first --wide commands expand every valid command so the book covers whatever the opponent
+// opens with, after that only the book's own command is followed, with both outcomes of a
+// volley. Positions --plies commands in aren't searched. The book is rewritten every
+// BOOK_SAVE_EVERY positions, so a run cut short still leaves one.
+//
+// usage: tazar_book [--out path] [--plies n] [--wide n] [--ms n] [--depth n] [--threads n]
+//                   [--tt mb]
+
+#include "tazar.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define BOOK_SAVE_EVERY 32
+
+typedef struct {
+    Game game;
+    u32 ply; // Commands since the start.
+} BookPosition;
+
+typedef struct {
+    BookPosition *positions; // Every position queued so far, searched up to `head`.
+    size_t count;
+    size_t capacity;
+    size_t head;
+    // Open addressing on Game.hash, index + 1 into `positions`, 0 for empty. Kept under half
+    // full. The book is keyed by the hash too, two positions with one hash share an entry anyway.
+    u32 *seen;
+    size_t seen_capacity;
+} BookQueue;
+
+static void *realloc_or_exit(void *ptr, size_t size) {
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return new_ptr;
+}
+
+static void queue_seen_insert(BookQueue *queue, size_t position_i) {
+    size_t mask = queue->seen_capacity - 1;
+    size_t slot = queue->positions[position_i].game.hash & mask;
+    while (queue->seen[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    queue->seen[slot] = (u32)(position_i + 1);
+}
+
+static void queue_push(BookQueue *queue, Game *game, u32 ply) {
+    if (queue->seen_capacity > 0) {
+        size_t mask = queue->seen_capacity - 1;
+        for (size_t slot = game->hash & mask; queue->seen[slot] != 0; slot = (slot + 1) & mask) {
+            if (queue->positions[queue->seen[slot] - 1].game.hash == game->hash) {
+                return;
+            }
+        }
+    }
+    if (queue->count >= queue->capacity) {
+        queue->capacity = queue->capacity == 0 ? 256 : queue->capacity * 2;
+        queue->positions =
+            realloc_or_exit(queue->positions, queue->capacity * sizeof(BookPosition));
+    }
+    queue->positions[queue->count++] = (BookPosition){.game = *game, .ply = ply};
+
+    if (queue->count * 2 > queue->seen_capacity) {
+        free(queue->seen);
+        queue->seen_capacity = queue->seen_capacity == 0 ? 1024 : queue->seen_capacity * 2;
+        queue->seen = calloc(queue->seen_capacity, sizeof(u32));
+        if (queue->seen == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < queue->count; i++) {
+            queue_seen_insert(queue, i);
+        }
+    } else {
+        queue_seen_insert(queue, queue->count - 1);
+    }
+}
+
+static u32 core_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (u32)info.dwNumberOfProcessors : 1;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (u32)cores : 1;
+#endif
+}
+
+// Queue what `command` leads to, both outcomes if it's a volley.
+static void queue_child(BookQueue *queue, BookPosition *position, Command command, u32 plies) {
+    if (position->ply + 1 >= plies) {
+        return;
+    }
+    VolleyResult outcomes[2] = {VOLLEY_ROLL};
+    size_t outcome_count = 1;
+    if (command.kind == COMMAND_VOLLEY) {
+        outcomes[0] = VOLLEY_HIT;
+        outcomes[1] = VOLLEY_MISS;
+        outcome_count = 2;
+    }
+    for (size_t i = 0; i < outcome_count; i++) {
+        Game child = position->game;
+        game_apply_command(&child, child.turn.player, command, outcomes[i]);
+        if (child.status == STATUS_IN_PROGRESS) {
+            queue_push(queue, &child, position->ply + 1);
+        }
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--out path] [--plies n] [--wide n] [--ms n] [--depth n] [--threads n]\n"
+            "       [--tt mb]\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *out = "tazar.book";
+    u32 plies = 8;
+    u32 wide = 1;
+    AITurn ai_turn = {
+        .difficulty = AIDIFF_HARD,
+        .tt_size_mb = 256,
+        .time_budget_ms = 5000,
+        .threads = core_count(),
+        .search_always = true,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--out") == 0 && has_value) {
+            out = argv[++i];
+        } else if (strcmp(arg, "--plies") == 0 && has_value) {
+            plies = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--wide") == 0 && has_value) {
+            wide = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--ms") == 0 && has_value) {
+            ai_turn.time_budget_ms = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--depth") == 0 && has_value) {
+            ai_turn.max_depth = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            ai_turn.threads = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--tt") == 0 && has_value) {
+            ai_turn.tt_size_mb = (u32)strtoul(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (plies == 0 || ai_turn.time_budget_ms == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    printf("book %s: plies %u wide %u ms %u depth %u threads %u\n", out, plies, wide,
+           ai_turn.time_budget_ms, ai_turn.max_depth, ai_turn.threads);
+
+    BookQueue queue = {0};
+    Game start;
+    game_init(&start, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
+    queue_push(&queue, &start, 0);
+
+    AIBookEntry *entries = NULL;
+    size_t entry_count = 0;
+    size_t entry_capacity = 0;
+    CommandBuf commands = {0};
+    double start_ms = time_now_ms();
+
+    while (queue.head < queue.count) {
+        // By value, pushing children can move the queue.
+        BookPosition position = queue.positions[queue.head++];
+        ai_turn.game = position.game;
+        atomic_store(&ai_turn.stop, false);
+        ai_select_command(&ai_turn);
+        game_valid_commands(&commands, &position.game);
+        Command best = commands.commands[ai_turn.selected_command_i];
+
+        if (entry_count >= entry_capacity) {
+            entry_capacity = entry_capacity == 0 ? 256 : entry_capacity * 2;
+            entries = realloc_or_exit(entries, sizeof(AIBookEntry) * entry_capacity);
+        }
+        entries[entry_count++] = (AIBookEntry){
+            .hash = position.game.hash,
+            .command = best,
+            .score = ai_turn.score,
+            .depth = ai_turn.depth_completed,
+        };
+
+        char text[COMMAND_TEXT_MAX];
+        command_format(best, text, sizeof(text));
+        printf("%zu/%zu ply %u %016llx %s depth %u score %.4f\n", queue.head, queue.count,
+               position.ply, (unsigned long long)position.game.hash, text,
+               ai_turn.depth_completed, ai_turn.score);
+        fflush(stdout);
+
+        if (position.ply < wide) {
+            for (size_t i = 0; i < commands.count; i++) {
+                queue_child(&queue, &position, commands.commands[i], plies);
+            }
+        } else {
+            queue_child(&queue, &position, best, plies);
+        }
+
+        if (entry_count % BOOK_SAVE_EVERY == 0 && !ai_book_write(out, entries, entry_count)) {
+            fprintf(stderr, "couldn't write %s\n", out);
+            return 1;
+        }
+    }
+
+    if (!ai_book_write(out, entries, entry_count)) {
+        fprintf(stderr, "couldn't write %s\n", out);
+        return 1;
+    }
+    printf("%zu positions in %.1f s\n", entry_count, (time_now_ms() - start_ms) / 1000.0);
+    free(commands.commands);
+    free(entries);
+    free(queue.positions);
+    free(queue.seen);
+    ai_state_free(ai_turn.ai_state);
+    return 0;
+}
@@ -0,0 +1,257 @@
+// Headless engine, a line based text protocol on stdin and stdout in the spirit of UCI.
+//
+// Only the rules engine and the AI, no SDL or ImGui, so it starts in milliseconds and a host can
+// run many of them. Commands are the single words of `command_format`, a volley is followed by
+// its outcome, "hit" or "miss", wherever the position changes.
+//
+//   tazar                     -> id name tazar_engine, tazarok
+//   isready                   -> readyok
+//   newgame                   start position, drops the AI state and its transposition table
+//   position startpos [commands <command> [hit|miss] ...]
+//   apply <command> [hit|miss]
+//   commands                  -> commands <command> ..., the valid commands of the position
+//   print                     -> info player red|blue status in_progress|over hash <hex> ...
+//   go [depth <n>] [movetime <ms>] [nodes <n>] [threads <n>] [difficulty easy|medium|hard|mcts]
+//      [turns]                -> info depth <n> score <s> nodes <n> nps <n> time <ms>
+//                                bestmove <command>
+//   quit
+//
+// `score` is from the side to move's point of view, -1 lost to 1 won. Unset limits of `go` use
+// the difficulty's, hard by default, and when any limit is given the others don't apply. `nodes`
+// limits playouts for mcts. Errors are reported as "error <message>" and change nothing.
+//
+// usage: tazar_engine
+
+#include "tazar.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENGINE_LINE_MAX (1 << 16)
+#define ENGINE_DELIMITERS " \t\r\n"
+
+typedef struct {
+    Game game;
+    AITurn ai_turn;
+    CommandBuf commands;
+} Engine;
+
+static void engine_new_game(Engine *engine) {
+    game_init(&engine->game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
+    ai_state_free(engine->ai_turn.ai_state);
+    engine->ai_turn = (AITurn){0};
+}
+
+// Apply the command in `word`, reading the volley's outcome from the next word. Invalid commands
+// leave `game` as it was.
+static bool engine_apply(Engine *engine, Game *game, const char *word) {
+    Command command;
+    if (word == NULL || !command_parse(word, &command)) {
+        printf("error expected a command, got '%s'\n", word != NULL ? word : "");
+        return false;
+    }
+    game_valid_commands(&engine->commands, game);
+    bool valid = false;
+    for (size_t i = 0; i < engine->commands.count; i++) {
+        valid = valid || command_eq(&engine->commands.commands[i], &command);
+    }
+    if (!valid) {
+        printf("error '%s' isn't a valid command here\n", word);
+        return false;
+    }
+    VolleyResult volley_result = VOLLEY_ROLL;
+    if (command.kind == COMMAND_VOLLEY) {
+        const char *outcome = strtok(NULL, ENGINE_DELIMITERS);
+        if (outcome != NULL && strcmp(outcome, "hit") == 0) {
+            volley_result = VOLLEY_HIT;
+        } else if (outcome != NULL && strcmp(outcome, "miss") == 0) {
+            volley_result = VOLLEY_MISS;
+        } else {
+            printf("error volley '%s' needs hit or miss\n", word);
+            return false;
+        }
+    }
+    game_apply_command(game, game->turn.player, command, volley_result);
+    return true;
+}
+
+static void engine_position(Engine *engine) {
+    const char *word = strtok(NULL, ENGINE_DELIMITERS);
+    if (word == NULL || strcmp(word, "startpos") != 0) {
+        printf("error position needs startpos\n");
+        return;
+    }
+    Game game;
+    game_init(&game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
+    word = strtok(NULL, ENGINE_DELIMITERS);
+    if (word != NULL) {
+        if (strcmp(word, "commands") != 0) {
+            printf("error expected commands, got '%s'\n", word);
+            return;
+        }
+        while ((word = strtok(NULL, ENGINE_DELIMITERS)) != NULL) {
+            if (!engine_apply(engine, &game, word)) {
+                return;
+            }
+        }
+    }
+    engine->game = game;
+}
+
+static void engine_commands(Engine *engine) {
+    game_valid_commands(&engine->commands, &engine->game);
+    printf("commands");
+    for (size_t i = 0; i < engine->commands.count; i++) {
+        char text[COMMAND_TEXT_MAX];
+        command_format(engine->commands.commands[i], text, sizeof(text));
+        printf(" %s", text);
+    }
+    printf("\n");
+}
+
+static void engine_print(Engine *engine) {
+    Game *game = &engine->game;
+    printf("info player %s status %s", game->turn.player == PLAYER_RED ? "red" : "blue",
+           game->status == STATUS_OVER ? "over" : "in_progress");
+    if (game->status == STATUS_OVER) {
+        printf(" winner %s", game->winner == PLAYER_RED ? "red" : "blue");
+    }
+    printf(" hash %016" PRIx64 " material %d activation %u\n", game->hash, game->material,
+           game->turn.activation_i);
+}
+
+// Parse the number after a `go` option.
+static bool engine_number(const char *option, u64 *value) {
+    const char *word = strtok(NULL, ENGINE_DELIMITERS);
+    char *end = NULL;
+    unsigned long long number = word != NULL ? strtoull(word, &end, 10) : 0;
+    if (word == NULL || *end != '\0' || number == 0) {
+        printf("error %s needs a positive number\n", option);
+        return false;
+    }
+    *value = number;
+    return true;
+}
+
+static void engine_go(Engine *engine) {
+    if (engine->game.status != STATUS_IN_PROGRESS) {
+        printf("error the game is over\n");
+        return;
+    }
+    AITurn *ai_turn = &engine->ai_turn;
+    ai_turn->difficulty = AIDIFF_HARD;
+    ai_turn->time_budget_ms = 0;
+    ai_turn->max_depth = 0;
+    ai_turn->threads = 0;
+    ai_turn->playouts = 0;
+    ai_turn->max_nodes = 0;
+    ai_turn->plan_turns = false;
+    u64 depth = 0;
+    u64 movetime = 0;
+    u64 nodes = 0;
+    u64 threads = 0;
+    const char *word;
+    while ((word = strtok(NULL, ENGINE_DELIMITERS)) != NULL) {
+        bool ok = true;
+        if (strcmp(word, "depth") == 0) {
+            ok = engine_number(word, &depth);
+        } else if (strcmp(word, "movetime") == 0) {
+            ok = engine_number(word, &movetime);
+        } else if (strcmp(word, "nodes") == 0) {
+            ok = engine_number(word, &nodes);
+        } else if (strcmp(word, "threads") == 0) {
+            ok = engine_number(word, &threads);
+        } else if (strcmp(word, "turns") == 0) {
+            ai_turn->plan_turns = true;
+        } else if (strcmp(word, "difficulty") == 0) {
+            const char *names[] = {"easy", "medium", "hard", "mcts"};
+            const AIDifficulty difficulties[] = {AIDIFF_EASY, AIDIFF_MEDIUM, AIDIFF_HARD,
+                                                 AIDIFF_MCTS};
+            word = strtok(NULL, ENGINE_DELIMITERS);
+            ok = false;
+            for (size_t i = 0; i < 4 && word != NULL; i++) {
+                if (strcmp(word, names[i]) == 0) {
+                    ai_turn->difficulty = difficulties[i];
+                    ok = true;
+                }
+            }
+            if (!ok) {
+                printf("error unknown difficulty '%s'\n", word != NULL ? word : "");
+            }
+        } else {
+            printf("error unknown go option '%s'\n", word);
+            ok = false;
+        }
+        if (!ok) {
+            return;
+        }
+    }
+
+    // Any limit given replaces the difficulty's, the others are as good as unlimited.
+    bool limited = depth != 0 || movetime != 0 || nodes != 0;
+    ai_turn->max_depth = limited ? (depth != 0 ? (u32)depth : UINT32_MAX) : 0;
+    ai_turn->time_budget_ms = limited ? (movetime != 0 ? (u32)movetime : UINT32_MAX / 2) : 0;
+    ai_turn->max_nodes = nodes;
+    ai_turn->playouts = ai_turn->difficulty == AIDIFF_MCTS ? (u32)nodes : 0;
+    ai_turn->threads = (u32)threads;
+    ai_turn->game = engine->game;
+
+    double start_ms = time_now_ms();
+    ai_select_command(ai_turn);
+    double elapsed_ms = time_now_ms() - start_ms;
+
+    game_valid_commands(&engine->commands, &engine->game);
+    Command best = engine->commands.commands[ai_turn->selected_command_i];
+    char text[COMMAND_TEXT_MAX];
+    command_format(best, text, sizeof(text));
+    double score = engine->game.turn.player == PLAYER_RED ? ai_turn->score : -ai_turn->score;
+    score = score == 0.0 ? 0.0 : score; // No "-0.0000".
+    double nps = elapsed_ms > 0.0 ? (double)ai_turn->nodes * 1000.0 / elapsed_ms : 0.0;
+    printf("info depth %u score %.4f nodes %" PRIu64 " nps %.0f time %.0f\n",
+           ai_turn->depth_completed, score, ai_turn->nodes, nps, elapsed_ms);
+    printf("bestmove %s\n", text);
+}
+
+int main(void) {
+    static char line[ENGINE_LINE_MAX];
+    static Engine engine;
+    engine_new_game(&engine);
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        const char *word = strtok(line, ENGINE_DELIMITERS);
+        if (word == NULL) {
+            continue;
+        }
+        if (strcmp(word, "quit") == 0) {
+            break;
+        } else if (strcmp(word, "tazar") == 0) {
+            printf("id name tazar_engine\ntazarok\n");
+        } else if (strcmp(word, "isready") == 0) {
+            printf("readyok\n");
+        } else if (strcmp(word, "newgame") == 0) {
+            engine_new_game(&engine);
+        } else if (strcmp(word, "position") == 0) {
+            engine_position(&engine);
+        } else if (strcmp(word, "apply") == 0) {
+            Game game = engine.game;
+            if (engine_apply(&engine, &game, strtok(NULL, ENGINE_DELIMITERS))) {
+                engine.game = game;
+            }
+        } else if (strcmp(word, "commands") == 0) {
+            engine_commands(&engine);
+        } else if (strcmp(word, "print") == 0) {
+            engine_print(&engine);
+        } else if (strcmp(word, "go") == 0) {
+            engine_go(&engine);
+        } else {
+            printf("error unknown command '%s'\n", word);
+        }
+        fflush(stdout);
+    }
+
+    ai_state_free(engine.ai_turn.ai_state);
+    free(engine.commands.commands);
+    return 0;
+}
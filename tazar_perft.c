@@ -0,0 +1,134 @@
+// Headless move generation benchmark.
+//
+// Walks the game tree from the attrition start position using only the rules engine in tazar.c.
+// Every command is one ply, volleys branch into an explicit HIT and MISS child, so the counts
+// line up with the nodes `expecti_max_node` has to visit. Games that end before the requested
+// depth don't count as leaves, same as perft in chess.
+//
+// usage: tazar_perft [depth]
+
+#include "tazar.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PERFT_MAX_DEPTH 16
+
+// One command buffer per ply so the walk doesn't allocate once the buffers have grown.
+static CommandBuf perft_bufs[PERFT_MAX_DEPTH];
+// Every position visited, interior and leaf, used for nodes/sec.
+static uint64_t perft_nodes;
+
+static uint64_t perft(Game *game, int depth) {
+    perft_nodes++;
+    assert(game->hash == game_compute_hash(game));
+#ifndef NDEBUG
+    Game check = *game;
+    game_compute_bitboards(&check);
+    assert(memcmp(check.players, game->players, sizeof(game->players)) == 0);
+    assert(memcmp(check.kinds, game->kinds, sizeof(game->kinds)) == 0);
+    assert(memcmp(check.piece_counts, game->piece_counts, sizeof(game->piece_counts)) == 0);
+    assert(check.material == game->material);
+#endif
+    if (depth == 0) {
+        return 1;
+    }
+
+    CommandBuf *buf = &perft_bufs[depth];
+    game_valid_commands(buf, game);
+
+    uint64_t leaves = 0;
+    for (size_t i = 0; i < buf->count; i++) {
+        Command command = buf->commands[i];
+        if (command.kind == COMMAND_VOLLEY) {
+            UndoCommand undo = game_apply_command(game, game->turn.player, command, VOLLEY_HIT);
+            leaves += perft(game, depth - 1);
+            game_undo_command(game, undo);
+            undo = game_apply_command(game, game->turn.player, command, VOLLEY_MISS);
+            leaves += perft(game, depth - 1);
+            game_undo_command(game, undo);
+        } else {
+            UndoCommand undo = game_apply_command(game, game->turn.player, command, VOLLEY_ROLL);
+            leaves += perft(game, depth - 1);
+            game_undo_command(game, undo);
+        }
+    }
+    return leaves;
+}
+
+static void print_command(Command command, const char *suffix) {
+    char text[COMMAND_TEXT_MAX];
+    command_format(command, text, sizeof(text));
+    printf("%s%s", text, suffix);
+}
+
+// Leaf counts below each root command, the sum matches perft(depth).
+static uint64_t divide(Game *game, int depth) {
+    CommandBuf root = {0};
+    game_valid_commands(&root, game);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < root.count; i++) {
+        Command command = root.commands[i];
+        if (command.kind == COMMAND_VOLLEY) {
+            UndoCommand undo = game_apply_command(game, game->turn.player, command, VOLLEY_HIT);
+            uint64_t hit = perft(game, depth - 1);
+            game_undo_command(game, undo);
+            undo = game_apply_command(game, game->turn.player, command, VOLLEY_MISS);
+            uint64_t miss = perft(game, depth - 1);
+            game_undo_command(game, undo);
+            print_command(command, " hit");
+            printf(": %llu\n", (unsigned long long)hit);
+            print_command(command, " miss");
+            printf(": %llu\n", (unsigned long long)miss);
+            total += hit + miss;
+        } else {
+            UndoCommand undo = game_apply_command(game, game->turn.player, command, VOLLEY_ROLL);
+            uint64_t leaves = perft(game, depth - 1);
+            game_undo_command(game, undo);
+            print_command(command, "");
+            printf(": %llu\n", (unsigned long long)leaves);
+            total += leaves;
+        }
+    }
+    free(root.commands);
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    int max_depth = 4;
+    if (argc > 1) {
+        max_depth = atoi(argv[1]);
+    }
+    if (max_depth < 1 || max_depth >= PERFT_MAX_DEPTH) {
+        fprintf(stderr, "usage: %s [depth 1..%d]\n", argv[0], PERFT_MAX_DEPTH - 1);
+        return 1;
+    }
+
+    Game game;
+    game_init(&game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
+
+    printf("depth %12s %12s %10s %14s\n", "leaves", "nodes", "seconds", "nodes/sec");
+    for (int depth = 1; depth <= max_depth; depth++) {
+        perft_nodes = 0;
+        double start = time_now_ms() / 1000.0;
+        uint64_t leaves = perft(&game, depth);
+        double elapsed = time_now_ms() / 1000.0 - start;
+        double nps = elapsed > 0.0 ? (double)perft_nodes / elapsed : 0.0;
+        printf("%5d %12llu %12llu %10.3f %14.0f\n", depth, (unsigned long long)leaves,
+               (unsigned long long)perft_nodes, elapsed, nps);
+    }
+
+    printf("\ndivide %d\n", max_depth);
+    double start = time_now_ms() / 1000.0;
+    uint64_t total = divide(&game, max_depth);
+    double elapsed = time_now_ms() / 1000.0 - start;
+    printf("total: %llu (%.3f s)\n", (unsigned long long)total, elapsed);
+
+    for (int i = 0; i < PERFT_MAX_DEPTH; i++) {
+        free(perft_bufs[i].commands);
+    }
+    return 0;
+}
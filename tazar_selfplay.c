@@ -0,0 +1,376 @@
+// Self-play tournament between two AI configurations.
+//
+// Games run concurrently, one per worker thread, each with real VOLLEY_ROLL dice from its own
+// seed. MCTS playouts draw from the same generator, so with mcts the dice also depend on the
+// search. Games come in pairs that share a seed with the colors swapped, so neither side gets the
+// luckier dice or the first move more often. Results are from A's point of view with the Elo
+// difference and its 95% interval. With --sprt the run stops once the sequential probability
+// ratio test accepts elo0 (A isn't better by elo1) or elo1 (it is).
+//
+// usage: tazar_selfplay [--games n] [--concurrency n] [--seed n] [--max-commands n]
+//                       [--a config] [--b config] [--sprt elo0 elo1 [alpha beta]]
+//
+// A config is a comma separated list of difficulty=easy|medium|hard|mcts, depth=n, ms=n,
+// nodes=n, threads=n, parallel=smp|ybwc, playouts=n and turns. Unset limits use the difficulty's,
+// threads default to 1 so the games, not the searches, fill the cores. A defaults to medium and
+// B to easy.
+
+#include "tazar.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SELFPLAY_MAX_WORKERS 256
+// The normal approximation behind the LLR is poor for the first few games, a sweep of them has
+// almost no variance and would decide the test on its own.
+#define SPRT_MIN_GAMES 30
+
+typedef struct {
+    AIDifficulty difficulty;
+    u32 max_depth;
+    u32 time_budget_ms;
+    u64 max_nodes;
+    u32 threads;
+    AIParallel parallel;
+    u32 playouts;
+    bool plan_turns;
+} EngineConfig;
+
+typedef struct {
+    EngineConfig configs[2]; // A and B.
+    u32 games;
+    u32 max_commands; // A game this long is a draw.
+    u64 seed;
+    bool sprt;
+    double elo0;
+    double elo1;
+    double alpha;
+    double beta;
+
+    atomic_uint next_game;
+    atomic_uint wins; // For A.
+    atomic_uint losses;
+    atomic_uint draws;
+    atomic_bool stop;
+} Tournament;
+
+typedef struct {
+    Tournament *tournament;
+    pthread_t thread;
+    bool started;
+} Worker;
+
+static bool parse_config(const char *text, EngineConfig *config) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", text);
+    for (char *save = NULL, *item = strtok_r(buf, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+        }
+        if (strcmp(item, "turns") == 0) {
+            config->plan_turns = true;
+            continue;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "config: '%s' needs a value\n", item);
+            return false;
+        }
+        if (strcmp(item, "difficulty") == 0) {
+            const char *names[] = {"easy", "medium", "hard", "mcts"};
+            const AIDifficulty difficulties[] = {AIDIFF_EASY, AIDIFF_MEDIUM, AIDIFF_HARD,
+                                                 AIDIFF_MCTS};
+            bool found = false;
+            for (size_t i = 0; i < 4; i++) {
+                if (strcmp(value, names[i]) == 0) {
+                    config->difficulty = difficulties[i];
+                    found = true;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "config: unknown difficulty '%s'\n", value);
+                return false;
+            }
+        } else if (strcmp(item, "parallel") == 0) {
+            if (strcmp(value, "smp") == 0) {
+                config->parallel = AI_PARALLEL_LAZY_SMP;
+            } else if (strcmp(value, "ybwc") == 0) {
+                config->parallel = AI_PARALLEL_YBWC;
+            } else {
+                fprintf(stderr, "config: unknown parallel '%s'\n", value);
+                return false;
+            }
+        } else if (strcmp(item, "depth") == 0) {
+            config->max_depth = (u32)strtoul(value, NULL, 10);
+        } else if (strcmp(item, "ms") == 0) {
+            config->time_budget_ms = (u32)strtoul(value, NULL, 10);
+        } else if (strcmp(item, "nodes") == 0) {
+            config->max_nodes = strtoull(value, NULL, 10);
+        } else if (strcmp(item, "threads") == 0) {
+            config->threads = (u32)strtoul(value, NULL, 10);
+        } else if (strcmp(item, "playouts") == 0) {
+            config->playouts = (u32)strtoul(value, NULL, 10);
+        } else {
+            fprintf(stderr, "config: unknown key '%s'\n", item);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_config(const char *name, EngineConfig *config) {
+    const char *difficulties[] = {"human", "easy", "medium", "hard", "mcts"};
+    printf("%s: %s depth %u ms %u nodes %llu threads %u %s%s\n", name,
+           difficulties[config->difficulty], config->max_depth, config->time_budget_ms,
+           (unsigned long long)config->max_nodes, config->threads,
+           config->parallel == AI_PARALLEL_YBWC ? "ybwc" : "smp",
+           config->plan_turns ? " turns" : "");
+}
+
+// Play one game, 1 if red wins, -1 if blue wins and 0 for a draw.
+static int play_game(Tournament *tournament, AITurn *red, AITurn *blue, u64 seed) {
+    Game game;
+    game_init(&game, GAME_MODE_ATTRITION, MAP_HEX_FIELD_SMALL);
+    rand_seed(seed);
+    CommandBuf commands = {0};
+    int outcome = 0;
+    for (u32 i = 0; i < tournament->max_commands; i++) {
+        if (game.status == STATUS_OVER) {
+            outcome = game.winner == PLAYER_RED ? 1 : -1;
+            break;
+        }
+        AITurn *ai_turn = game.turn.player == PLAYER_RED ? red : blue;
+        ai_turn->game = game;
+        ai_select_command(ai_turn);
+        game_valid_commands(&commands, &game);
+        assert(ai_turn->selected_command_i < commands.count);
+        Command command = commands.commands[ai_turn->selected_command_i];
+        game_apply_command(&game, game.turn.player, command, VOLLEY_ROLL);
+    }
+    free(commands.commands);
+    return outcome;
+}
+
+static void *worker_main(void *ptr) {
+    Worker *worker = ptr;
+    Tournament *tournament = worker->tournament;
+    // Each side keeps its AI state, the transposition tables, from game to game.
+    AITurn ai_turns[2];
+    for (size_t i = 0; i < 2; i++) {
+        EngineConfig *config = &tournament->configs[i];
+        ai_turns[i] = (AITurn){
+            .difficulty = config->difficulty,
+            .ai_state = NULL,
+            .time_budget_ms = config->time_budget_ms,
+            .max_depth = config->max_depth,
+            .threads = config->threads,
+            .parallel = config->parallel,
+            .plan_turns = config->plan_turns,
+            .playouts = config->playouts,
+            .max_nodes = config->max_nodes,
+        };
+    }
+
+    while (!atomic_load(&tournament->stop)) {
+        u32 game_i = atomic_fetch_add(&tournament->next_game, 1);
+        if (game_i >= tournament->games) {
+            break;
+        }
+        // A is red in even games. Both games of a pair roll from the same seed.
+        bool a_red = (game_i & 1) == 0;
+        u64 seed = tournament->seed + game_i / 2;
+        int outcome = a_red ? play_game(tournament, &ai_turns[0], &ai_turns[1], seed)
+                            : -play_game(tournament, &ai_turns[1], &ai_turns[0], seed);
+        if (outcome > 0) {
+            atomic_fetch_add(&tournament->wins, 1);
+        } else if (outcome < 0) {
+            atomic_fetch_add(&tournament->losses, 1);
+        } else {
+            atomic_fetch_add(&tournament->draws, 1);
+        }
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        ai_state_free(ai_turns[i].ai_state);
+    }
+    return NULL;
+}
+
+static double elo_from_score(double score) {
+    return -400.0 * log10(1.0 / score - 1.0);
+}
+
+static double score_from_elo(double elo) {
+    return 1.0 / (1.0 + pow(10.0, -elo / 400.0));
+}
+
+typedef struct {
+    u32 games;
+    double elo;
+    double elo_error; // 95% interval is elo +- this.
+    double llr;       // SPRT log likelihood ratio of elo1 against elo0.
+} Stats;
+
+static Stats compute_stats(Tournament *tournament, u32 wins, u32 losses, u32 draws) {
+    Stats stats = {.games = wins + losses + draws};
+    if (stats.games == 0) {
+        return stats;
+    }
+    double n = stats.games;
+    double score = (wins + 0.5 * draws) / n;
+    double variance = (wins * pow(1.0 - score, 2) + losses * pow(score, 2) +
+                       draws * pow(0.5 - score, 2)) / n;
+    // Clamp so a clean sweep still prints a number.
+    double clamped = fmin(fmax(score, 0.5 / n), 1.0 - 0.5 / n);
+    stats.elo = elo_from_score(clamped);
+    double error = 1.96 * sqrt(variance / n);
+    double high = fmin(clamped + error, 1.0 - 0.5 / n);
+    double low = fmax(clamped - error, 0.5 / n);
+    stats.elo_error = (elo_from_score(high) - elo_from_score(low)) / 2.0;
+    if (variance > 0.0) {
+        // Normal approximation of the game results, as most testing frameworks do.
+        double s0 = score_from_elo(tournament->elo0);
+        double s1 = score_from_elo(tournament->elo1);
+        stats.llr = n * (s1 - s0) * (2.0 * score - s0 - s1) / (2.0 * variance);
+    }
+    return stats;
+}
+
+static void print_stats(Tournament *tournament, Stats stats, u32 wins, u32 losses, u32 draws) {
+    printf("games %u: +%u -%u =%u  elo %+.1f +- %.1f", stats.games, wins, losses, draws, stats.elo,
+           stats.elo_error);
+    if (tournament->sprt) {
+        double lower = log(tournament->beta / (1 - tournament->alpha));
+        double upper = log((1 - tournament->beta) / tournament->alpha);
+        printf("  llr %.2f [%.2f, %.2f]", stats.llr, lower, upper);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--games n] [--concurrency n] [--seed n] [--max-commands n]\n"
+            "       [--a config] [--b config] [--sprt elo0 elo1 [alpha beta]]\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    static Tournament tournament = {
+        .configs = {{.difficulty = AIDIFF_MEDIUM, .threads = 1},
+                    {.difficulty = AIDIFF_EASY, .threads = 1}},
+        .games = 100,
+        .max_commands = 1000,
+        .seed = 1,
+        .alpha = 0.05,
+        .beta = 0.05,
+    };
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 concurrency = cores > 0 ? (u32)cores : 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--games") == 0 && has_value) {
+            tournament.games = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--concurrency") == 0 && has_value) {
+            concurrency = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--seed") == 0 && has_value) {
+            tournament.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--max-commands") == 0 && has_value) {
+            tournament.max_commands = (u32)strtoul(argv[++i], NULL, 10);
+        } else if ((strcmp(arg, "--a") == 0 || strcmp(arg, "--b") == 0) && has_value) {
+            if (!parse_config(argv[++i], &tournament.configs[arg[2] == 'a' ? 0 : 1])) {
+                return 1;
+            }
+        } else if (strcmp(arg, "--sprt") == 0 && i + 2 < argc) {
+            tournament.sprt = true;
+            tournament.elo0 = atof(argv[++i]);
+            tournament.elo1 = atof(argv[++i]);
+            if (i + 2 < argc && argv[i + 1][0] != '-') {
+                tournament.alpha = atof(argv[++i]);
+                tournament.beta = atof(argv[++i]);
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (concurrency < 1 || concurrency > SELFPLAY_MAX_WORKERS || tournament.games == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    print_config("a", &tournament.configs[0]);
+    print_config("b", &tournament.configs[1]);
+    printf("%u games, %u at a time, seed %llu\n", tournament.games, concurrency,
+           (unsigned long long)tournament.seed);
+
+    static Worker workers[SELFPLAY_MAX_WORKERS];
+    double start_ms = time_now_ms();
+    u32 started = 0;
+    for (u32 i = 0; i < concurrency; i++) {
+        workers[i] = (Worker){.tournament = &tournament};
+        workers[i].started = pthread_create(&workers[i].thread, NULL, worker_main,
+                                            &workers[i]) == 0;
+        started += workers[i].started;
+    }
+    if (started == 0) {
+        fprintf(stderr, "couldn't start any worker threads\n");
+        return 1;
+    }
+
+    // Report as games finish, and stop early once the SPRT decides.
+    double lower = log(tournament.beta / (1 - tournament.alpha));
+    double upper = log((1 - tournament.beta) / tournament.alpha);
+    u32 reported = 0;
+    Stats stats = {0};
+    u32 wins = 0;
+    u32 losses = 0;
+    u32 draws = 0;
+    while (reported < tournament.games) {
+        usleep(100 * 1000);
+        wins = atomic_load(&tournament.wins);
+        losses = atomic_load(&tournament.losses);
+        draws = atomic_load(&tournament.draws);
+        stats = compute_stats(&tournament, wins, losses, draws);
+        if (stats.games == reported) {
+            continue;
+        }
+        reported = stats.games;
+        print_stats(&tournament, stats, wins, losses, draws);
+        bool decided = stats.games >= SPRT_MIN_GAMES && (stats.llr <= lower || stats.llr >= upper);
+        if (tournament.sprt && decided) {
+            atomic_store(&tournament.stop, true);
+            break;
+        }
+    }
+    for (u32 i = 0; i < concurrency; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    wins = atomic_load(&tournament.wins);
+    losses = atomic_load(&tournament.losses);
+    draws = atomic_load(&tournament.draws);
+    stats = compute_stats(&tournament, wins, losses, draws);
+    printf("\nfinal, %.1f s\n", (time_now_ms() - start_ms) / 1000.0);
+    print_stats(&tournament, stats, wins, losses, draws);
+    if (tournament.sprt) {
+        bool enough = stats.games >= SPRT_MIN_GAMES;
+        const char *verdict = enough && stats.llr >= upper   ? "H1 accepted, A is stronger by elo1"
+                              : enough && stats.llr <= lower ? "H0 accepted, A isn't stronger"
+                                                             : "inconclusive";
+        printf("sprt elo0 %.1f elo1 %.1f alpha %.2f beta %.2f: %s\n", tournament.elo0,
+               tournament.elo1, tournament.alpha, tournament.beta, verdict);
+    }
+    return 0;
+}